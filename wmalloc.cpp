@@ -21,6 +21,8 @@
 
 #include "wmalloc.h"
 
+#include <atomic>
+
 namespace Wulf {
     namespace Sys {
         const size_t complemem_blocksize_default = 8;
@@ -45,6 +47,87 @@ namespace Wulf {
             return MallocErrorPtr;
         }
 
+        //予算の管理。判定はdataの確保・拡張時にしか行わないので、wmallocの通常の経路には影響しない
+        //global_committedは複数のスレッドのSysMemから同時に更新されるので、
+        //拡張する分をCASで先に予約してからmalloc/reallocする
+        static std::atomic<size_t> global_committed(0);
+        static std::atomic<size_t> global_softlimit(0);
+        static std::atomic<size_t> global_hardlimit(0);
+        static std::atomic<Budget_f> global_softfun(NULL);
+
+        static void unreserveBudget(size_t grow)
+        {
+            global_committed -= grow;
+            return;
+        }
+
+        //growバイトの拡張を予約できれば0、予算を超えるなら-1
+        //0を返したときは呼び出し側が確保に失敗したらunreserveBudgetで返却する
+        //memはCompleMemの拡張ならNULL
+        static int reserveBudget(SysMem mem, size_t grow)
+        {
+            if (mem != NULL) {
+                size_t bytes = mem->allsize * sizeof(Pointer) + grow;
+                if (mem->hardlimit != 0 && bytes > mem->hardlimit) {
+                    return -1;
+                }
+            }
+
+            size_t hardlimit = global_hardlimit.load();
+            size_t current = global_committed.load();
+            do {
+                if (hardlimit != 0 && current + grow > hardlimit) {
+                    return -1;
+                }
+            } while (!global_committed.compare_exchange_weak(current, current + grow));
+            size_t committed = current + grow;
+
+            //softfunは予約した後に呼ぶ。softfunの中でtrimされた分は予約と独立に差し引かれる
+            if (mem != NULL) {
+                size_t bytes = mem->allsize * sizeof(Pointer) + grow;
+                if (mem->softlimit != 0 && bytes > mem->softlimit && mem->softfun != NULL) {
+                    if ((*mem->softfun)(mem, bytes, mem->softlimit) != 0) {
+                        unreserveBudget(grow);
+                        return -1;
+                    }
+                }
+            }
+
+            size_t softlimit = global_softlimit.load();
+            Budget_f softfun = global_softfun.load();
+            if (softlimit != 0 && committed > softlimit && softfun != NULL) {
+                if ((*softfun)(mem, committed, softlimit) != 0) {
+                    unreserveBudget(grow);
+                    return -1;
+                }
+            }
+            return 0;
+        }
+
+        void setSysMemBudget(SysMem mem, size_t softlimit, size_t hardlimit, Budget_f softfun)
+        {
+            if (mem == NULL) {
+                return;
+            }
+            mem->softlimit = softlimit;
+            mem->hardlimit = hardlimit;
+            mem->softfun = softfun;
+            return;
+        }
+
+        void setGlobalBudget(size_t softlimit, size_t hardlimit, Budget_f softfun)
+        {
+            global_softlimit.store(softlimit);
+            global_hardlimit.store(hardlimit);
+            global_softfun.store(softfun);
+            return;
+        }
+
+        size_t committedSize(void)
+        {
+            return global_committed;
+        }
+
         SysMem combine(SysMem mem, CompleMem cmem)
         {
             if (mem == NULL || cmem == NULL) {
@@ -71,9 +154,15 @@ namespace Wulf {
             cmem->blocksize = blocksize;
             cmem->last = 0;
             cmem->partner = NULL;
-            cmem->freestack = (SysStack)WMPNULL;
+            cmem->freelist = WMPNULL;
+            cmem->pincount = 0;
+            if (reserveBudget(NULL, cmem->allsize * sizeof(Pointer)) != 0) {
+                free(cmem);
+                return NULL;
+            }
             cmem->data = (Pointer *)malloc(cmem->allsize * sizeof(Pointer));
             if (cmem->data == NULL) {
+                unreserveBudget(cmem->allsize * sizeof(Pointer));
                 free(cmem);
                 SystemMallocError(0, (const void *)"System Memory Exhaustion");
                 return NULL;
@@ -88,6 +177,7 @@ namespace Wulf {
             }
 
             if (*cmem != NULL) {
+                global_committed -= (*cmem)->allsize * sizeof(Pointer);
                 free((*cmem)->data);
                 free(*cmem);
                 *cmem = NULL;
@@ -102,19 +192,24 @@ namespace Wulf {
             }
 
             //フリー済みがあればそっちを優先
-            void *ret;
-            if (cmem->freestack != (SysStack)WMPNULL) {
-                ret = pop(cmem->partner, cmem->freestack);
-                if (ret != NULL) {
-                    return (wmptr_t)ret;
-                }
+            if (cmem->freelist != WMPNULL) {
+                wmptr_t ret = cmem->freelist;
+                cmem->freelist = (wmptr_t)cmem->data[ret];
+                return ret;
             }
 
             //cmem->last + 1 == cmem->allsizeで満杯
             if ((cmem->last + 1) * cmem->blocksize >= cmem->allsize) {
+                if (cmem->pincount != 0) {
+                    return WMPNULL;
+                }
+                if (reserveBudget(NULL, cmem->pagesize * sizeof(Pointer)) != 0) {
+                    return WMPNULL;
+                }
                 size_t newsize = cmem->allsize + cmem->pagesize;
                 Pointer *buf = (Pointer *)realloc(cmem->data, newsize * sizeof(Pointer));
                 if (buf == NULL) {
+                    unreserveBudget(cmem->pagesize * sizeof(Pointer));
                     SystemMallocError(0, (const void *)"System Memory Exhaustion");
                     return WMPNULL;
                 }
@@ -126,15 +221,12 @@ namespace Wulf {
 
         void complefree(CompleMem cmem, wmptr_t p)
         {
-            if (cmem == NULL || p == (wmptr_t)NULL || p == WMPNULL) {
+            if (cmem == NULL || p == WMPNULL) {
                 return;
             }
 
-            if(cmem->freestack == (SysStack)WMPNULL) {
-                cmem->freestack = initSysStack(cmem->partner);
-            } 
-
-            push(cmem->partner, cmem->freestack, (void *)p);
+            cmem->data[p] = (Pointer)cmem->freelist;
+            cmem->freelist = p;
             return;
         }
 
@@ -152,9 +244,22 @@ namespace Wulf {
             mem->blocksize = blocksize;
             mem->last = 0;
             mem->partner = NULL;
-            mem->freestack = (SysStack)WMPNULL;
+            mem->freelist = WMPNULL;
+            mem->softlimit = 0;
+            mem->hardlimit = 0;
+            mem->softfun = NULL;
+            mem->pincount = 0;
+            mem->generation = 0;
+            mem->stalelo = 0;
+            mem->stalehi = 0;
+            mem->lastrelease = 0;
+            if (reserveBudget(NULL, mem->allsize * sizeof(Pointer)) != 0) {
+                free(mem);
+                return NULL;
+            }
             mem->data = (Pointer *)malloc(mem->allsize * sizeof(Pointer));
             if (mem->data == NULL) {
+                unreserveBudget(mem->allsize * sizeof(Pointer));
                 free(mem);
                 SystemMallocError(0, (const void *)"System Memory Exhaustion");
                 return NULL;
@@ -168,6 +273,7 @@ namespace Wulf {
                 return;
             }
             if (*mem != NULL) {
+                global_committed -= (*mem)->allsize * sizeof(Pointer);
                 free((*mem)->data);
                 free(*mem);
                 *mem = NULL;
@@ -181,22 +287,25 @@ namespace Wulf {
                 return WMPNULL;
             }
 
-            void *ret;
-            if (mem->freestack != (SysStack)WMPNULL) {
-                SysStack freestack = (SysStack)&mem->partner->data[(wmptr_t)mem->freestack];
-                if (freestack->head != WMPNULL) {
-                    ret = pop(mem, mem->freestack);
-                    if (ret != NULL) {
-                        return (wmptr_t)ret;
-                    }
-                }
+            if (mem->freelist != WMPNULL) {
+                wmptr_t ret = mem->freelist;
+                mem->freelist = (wmptr_t)mem->data[ret];
+                return ret;
             }
 
             //(mem->last + 1) * mem->blocksize == mem->allsizeで満杯
             if ((mem->last + 1) * mem->blocksize >= mem->allsize) {
+                if (mem->pincount != 0) {
+                    return WMPNULL;
+                }
+                //softfunがmemをtrimしてもよいよう、newsizeは判定の後で求める
+                if (reserveBudget(mem, mem->pagesize * sizeof(Pointer)) != 0) {
+                    return WMPNULL;
+                }
                 size_t newsize = mem->allsize + mem->pagesize;
                 Pointer *buf = (Pointer *)realloc(mem->data, newsize * sizeof(Pointer));
                 if (buf == NULL) {
+                    unreserveBudget(mem->pagesize * sizeof(Pointer));
                     return WMPNULL;
                 }
                 mem->data = buf;
@@ -206,20 +315,183 @@ namespace Wulf {
             return (wmptr_t)((mem->last)++ * mem->blocksize);
         }
 
-        //wmallocしたもの以外をwmfreeした場合は、次にwmallocしたときに
-        //そこにpagesize分を確保するということである。
-        //十分な長さを持ちstableな領域であれば問題ないが、
-        //スタック領域のメモリなどを使うと動作は未定となる。
-        //なお、グローバル変数として確保した配列をあらかじめwmfreeしておくことで
-        //そこを優先的に使用するというハックも可能。
+        //解放したブロックの先頭に次の添字を書いて連結する。
+        //wmallocもwmfreeも新たな領域を必要としないので、領域不足で失敗することはない。
+        //pにはwmallocで得た添字以外を渡してはならない。
         void wmfree(SysMem mem, wmptr_t p)
         {
-            if (mem->freestack == NULL) {
-                mem->freestack = initSysStack(mem);
+            if (mem == NULL || p == WMPNULL) {
+                return;
             }
 
-            push(mem, mem->freestack, (void *)p);
-            
+            mem->data[p] = (Pointer)mem->freelist;
+            mem->freelist = p;
+            return;
+        }
+
+        //領域の中身は捨てるがdataは解放しないので、確保済みの容量はそのまま再利用される。
+        void resetCompleMem(CompleMem cmem)
+        {
+            if (cmem == NULL) {
+                return;
+            }
+
+            cmem->last = 0;
+            cmem->freelist = WMPNULL;
+            //partnerのmarkはcomplelastを含むので、それまでのmarkをすべて無効にする
+            if (cmem->partner != NULL) {
+                cmem->partner->stalelo = 0;
+                cmem->partner->stalehi = cmem->partner->generation;
+                cmem->partner->lastrelease = 0;
+            }
+            return;
+        }
+
+        void resetSysMem(SysMem mem)
+        {
+            if (mem == NULL) {
+                return;
+            }
+
+            mem->last = 0;
+            mem->freelist = WMPNULL;
+            mem->stalelo = 0;
+            mem->stalehi = mem->generation;
+            mem->lastrelease = 0;
+            return;
+        }
+
+        //使用中の領域+1ブロックを含む最小のページ数まで縮める(wmallocの満杯判定に合わせる)
+        //pinされている間はdataを動かせないので何もしない
+        void trimCompleMem(CompleMem cmem)
+        {
+            if (cmem == NULL || cmem->pagesize == 0 || cmem->pincount != 0) {
+                return;
+            }
+
+            size_t newsize = ((cmem->last + 1) * cmem->blocksize / cmem->pagesize + 1) * cmem->pagesize;
+            if (newsize >= cmem->allsize) {
+                return;
+            }
+            Pointer *buf = (Pointer *)realloc(cmem->data, newsize * sizeof(Pointer));
+            if (buf == NULL) {
+                return;
+            }
+            global_committed -= (cmem->allsize - newsize) * sizeof(Pointer);
+            cmem->data = buf;
+            cmem->allsize = newsize;
+            return;
+        }
+
+        void trimSysMem(SysMem mem)
+        {
+            if (mem == NULL || mem->pagesize == 0 || mem->pincount != 0) {
+                return;
+            }
+
+            size_t newsize = ((mem->last + 1) * mem->blocksize / mem->pagesize + 1) * mem->pagesize;
+            if (newsize >= mem->allsize) {
+                return;
+            }
+            Pointer *buf = (Pointer *)realloc(mem->data, newsize * sizeof(Pointer));
+            if (buf == NULL) {
+                return;
+            }
+            global_committed -= (mem->allsize - newsize) * sizeof(Pointer);
+            mem->data = buf;
+            mem->allsize = newsize;
+            return;
+        }
+
+        //pinの間に拡張が必要になったwmalloc/complemallocはWMPNULLを返す
+        void pinCompleMem(CompleMem cmem)
+        {
+            if (cmem == NULL) {
+                return;
+            }
+            cmem->pincount++;
+            return;
+        }
+
+        void unpinCompleMem(CompleMem cmem)
+        {
+            if (cmem == NULL || cmem->pincount == 0) {
+                return;
+            }
+            cmem->pincount--;
+            return;
+        }
+
+        void pinSysMem(SysMem mem)
+        {
+            if (mem == NULL) {
+                return;
+            }
+            mem->pincount++;
+            return;
+        }
+
+        void unpinSysMem(SysMem mem)
+        {
+            if (mem == NULL || mem->pincount == 0) {
+                return;
+            }
+            mem->pincount--;
+            return;
+        }
+
+        SysMark markSysMem(SysMem mem)
+        {
+            SysMark mark;
+            mark.last = WMPNULL;
+            mark.complelast = WMPNULL;
+            mark.generation = 0;
+            if (mem == NULL) {
+                return mark;
+            }
+
+            mark.last = mem->last;
+            if (mem->partner != NULL) {
+                mark.complelast = mem->partner->last;
+            }
+            mark.generation = ++mem->generation;
+            return mark;
+        }
+
+        //markは入れ子にできる。markまでreleaseすると、それより後に作ったmarkはすべて無効になり、
+        //以後lastがそこを超えて伸びてもreleaseしても何もしない。
+        //無効なmarkの番号は1つの区間(stalelo, stalehi]で覆う。離れた2つの区間は間を含めて1つにまとめるので、
+        //間にある有効なmarkまで無効とみなすことがあるが、無効なmarkを有効とみなすことはない。
+        //最後にreleaseしたmarkは区間に含まれても有効なので、同じmarkへのreleaseは繰り返せる。
+        //freelistにはmarkより後ろの領域が含まれうるので捨てる。
+        //そのためmark以前に確保してmark以降にwmfreeした領域は、次のresetまで再利用されない。
+        void releaseSysMem(SysMem mem, SysMark mark)
+        {
+            if (mem == NULL || mark.last == WMPNULL || mark.last > mem->last) {
+                return;
+            }
+            if (mark.generation == 0 || mark.generation > mem->generation) {
+                return;
+            }
+            if (mark.generation != mem->lastrelease &&
+                mark.generation > mem->stalelo && mark.generation <= mem->stalehi) {
+                return;
+            }
+
+            if (mark.generation <= mem->stalelo || mem->stalehi == mem->stalelo) {
+                mem->stalelo = mark.generation;
+            }
+            mem->stalehi = mem->generation;
+            mem->lastrelease = mark.generation;
+
+            mem->last = mark.last;
+            mem->freelist = WMPNULL;
+            if (mem->partner != NULL) {
+                if (mark.complelast <= mem->partner->last) {
+                    mem->partner->last = mark.complelast;
+                }
+                mem->partner->freelist = WMPNULL;
+            }
             return;
         }
 
@@ -349,7 +621,9 @@ namespace Wulf {
                     //今回のポップでスタックは空
                     stk->cursol = WMPNULL;
                     void *ret = mem->data[stk->head];
+                    //解放したブロックには連結リストが書かれるので、次のpushでは確保し直す
                     wmfree(mem, stk->head);
+                    stk->head = WMPNULL;
                     return ret;
                 }
 
@@ -377,81 +651,105 @@ namespace Wulf {
             return NULL;
         }
 
-        void push(SysMem mem, SysStack stk, void *p)
+        //領域が足りなければ何も書かずに-1を返す。
+        //initSysStackはpartnerをreallocしうるので、その後はstkを引き直す。
+        int push(SysMem mem, SysStack stk, void *p)
         {
             if (mem == NULL || stk == (SysStack)WMPNULL) {
-                return;
+                return -1;
             }
 
-            stk = (SysStack)&mem->partner->data[(wmptr_t)stk];
+            SysStack stkptr = stk;
+            stk = (SysStack)&mem->partner->data[(wmptr_t)stkptr];
 
             //基底スタック
             if (stk->cur == (SysStack)WMPNULL) {
                 if (stk->head == WMPNULL) {
+                    wmptr_t head = wmalloc(mem);
+                    if (head == WMPNULL) {
+                        return -1;
+                    }
                     stk->cursol = 0;
-                    stk->head = wmalloc(mem);
+                    stk->head = head;
                     mem->data[stk->head] = p;
-                    return;
+                    return 0;
                 }
 
                 if (stk->cursol == WMPNULL) {
                     //スタックは空
                     stk->cursol = 0;
                     mem->data[stk->head] = p;
-                    return;
+                    return 0;
                 }
 
                 //ここで悪魔的なことが起こっておりエラーになる
                 if (stk->cursol + 1 < mem->blocksize) {
                     stk->cursol += 1;
                     mem->data[stk->head + stk->cursol] = p;
-                    return;
+                    return 0;
                 }
 
                 //stk->cursol + 1 >= mem->blocksize
                 if (stk->upper == (SysStack)WMPNULL) {
-                    stk->upper = initSysStack(mem);
-                    SysStack upper = (SysStack)&mem->partner->data[(wmptr_t)stk->upper];
-                    upper->dim = stk->dim + 1;
+                    SysStack upper = initSysStack(mem);
+                    if (upper == (SysStack)WMPNULL) {
+                        return -1;
+                    }
+                    stk = (SysStack)&mem->partner->data[(wmptr_t)stkptr];
+                    stk->upper = upper;
+                    ((SysStack)&mem->partner->data[(wmptr_t)upper])->dim = stk->dim + 1;
                 }
-
-                push(mem, stk->upper, (void *)stk);
-                stk->cur = initSysStack(mem);
+            } else {
+                //stk->cur != NULL
                 SysStack cur = (SysStack)&mem->partner->data[(wmptr_t)stk->cur];
-                cur->cursol = 0;
-                cur->upper = stk->upper;
-                cur->head = wmalloc(mem);
-                mem->data[cur->head] = p;
-                return;
+                if (cur->cursol == WMPNULL) {
+                    //スタックは空
+                    if (cur->head == WMPNULL) {
+                        wmptr_t head = wmalloc(mem);
+                        if (head == WMPNULL) {
+                            return -1;
+                        }
+                        cur->head = head;
+                    }
+                    cur->cursol = 0;
+                    mem->data[cur->head] = p;
+                    return 0;
+                }
+                if (cur->cursol + 1 < mem->blocksize) {
+                    cur->cursol += 1;
+                    mem->data[cur->head + cur->cursol] = p;
+                    return 0;
+                }
             }
 
-            //stk->cur != NULL
-            SysStack cur = (SysStack)&mem->partner->data[(wmptr_t)stk->cur];
-            if (cur->cursol == WMPNULL) {
-                //スタックは空
-                if (cur->head == WMPNULL) {
-                    cur->head = wmalloc(mem);
-                }
-                cur->cursol = 0;
-                mem->data[cur->head] = p;
-                return;
+            //現在のスタックが満杯なので上位に積み、新しいスタックを作る。
+            //失敗しても元の状態に戻せるよう、先に必要な領域を確保しておく
+            wmptr_t head = wmalloc(mem);
+            if (head == WMPNULL) {
+                return -1;
             }
-            if (cur->cursol + 1 < mem->blocksize) {
-                cur->cursol += 1;
-                mem->data[cur->head + cur->cursol] = p;
-                return;
+            SysStack next = initSysStack(mem);
+            if (next == (SysStack)WMPNULL) {
+                wmfree(mem, head);
+                return -1;
+            }
+            stk = (SysStack)&mem->partner->data[(wmptr_t)stkptr];
+            SysStack full = stk->cur == (SysStack)WMPNULL ? stkptr : stk->cur;
+            if (push(mem, stk->upper, (void *)full) != 0) {
+                complefree(mem->partner, (wmptr_t)next);
+                wmfree(mem, head);
+                return -1;
             }
 
-            //cur->cursol + 1 >= mem->blocksize
-            push(mem, stk->upper, (void *)stk->cur);
-            stk->cur = initSysStack(mem);
-            cur = (SysStack)&mem->partner->data[(wmptr_t)stk->cur];
+            stk = (SysStack)&mem->partner->data[(wmptr_t)stkptr];
+            SysStack cur = (SysStack)&mem->partner->data[(wmptr_t)next];
             cur->cursol = 0;
             cur->upper = stk->upper;
-            cur->head = wmalloc(mem);
-            mem->data[cur->head] = p;
- 
-            return;
+            cur->head = head;
+            mem->data[head] = p;
+            stk->cur = next;
+
+            return 0;
         }
 
         void deleteSysStack(SysMem mem, SysStack *stk)
@@ -465,13 +763,767 @@ namespace Wulf {
                 return;
             }
             //本来は全体を解放するより複雑な再帰処理
-            wmfree(mem, (*stk)->head);
+            wmfree(mem, ((SysStack)&mem->partner->data[(wmptr_t)*stk])->head);
             complefree(mem->partner, (wmptr_t)*stk);
             *stk = (SysStack)WMPNULL;
 
             return;
         }
 
+        //SysHash
+        //Robin Hood法による開番地ハッシュ表。テーブルはSysMemのブロックを
+        //基数木状のディレクトリで束ねたもので、ブロックの先頭はdata[]の添字で
+        //保持するためSysMemのreallocに影響されない。
+        //拡張時は倍のテーブルに切り替え、以降の更新操作ごとに旧テーブルから
+        //少しずつ要素を移すので、1回の挿入で全体を再ハッシュすることはない。
+        //テーブルのブロックも書き込むときに1つずつ確保し、移し終えたものから返す。
+
+        static const size_t hash_slotwidth = 3;     //スロットあたりの要素数
+        static const size_t hash_migratestep = 8;   //1回の更新で移行するスロット数
+
+        //フィボナッチハッシュ。上位bitsビットを使うので下位ビットの偏りに強い。
+        //ただしキー自体が定数倍の等差数列だと乗数と重なって大きく偏る(0x9E3779B97F4A7C15の倍数を
+        //10万個入れると平均39スロット探す)ので、先に上位ワードを下位に畳んでおく
+        static inline size_t hashKey(uintptr_t key, size_t bits)
+        {
+            uint64_t x = (uint64_t)key;
+            x ^= x >> 32;
+            return (size_t)((x * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+        }
+
+        static inline size_t floorLog2(size_t n)
+        {
+            size_t ret = 0;
+            while (n >>= 1) {
+                ret++;
+            }
+            return ret;
+        }
+
+        //ディレクトリの段数。0ならrootがそのままスロットのブロック
+        //テーブルを作るときにだけ求め、syshash_tに持っておく
+        static inline unsigned int hashLevels(SysHash h, size_t bits)
+        {
+            unsigned int levels = 0;
+            for (size_t b = h->slotbits; b < bits; b += h->dirbits) {
+                levels++;
+            }
+            return levels;
+        }
+
+        //i番目のスロットの先頭。まだ確保されていないブロックならNULL
+        //mem->dataが動くのでwmallocを跨いで保持しないこと
+        static inline Pointer *hashSlot(SysMem mem, SysHash h, wmptr_t root, size_t levels, size_t i)
+        {
+            size_t blk = i >> h->slotbits;
+            wmptr_t node = root;
+            for (size_t l = levels; l > 0; l--) {
+                size_t idx = (blk >> ((l - 1) * h->dirbits)) & (((size_t)1 << h->dirbits) - 1);
+                node = (wmptr_t)mem->data[node + idx];
+                if (node == WMPNULL) {
+                    return NULL;
+                }
+            }
+            return &mem->data[node + (i & (((size_t)1 << h->slotbits) - 1)) * hash_slotwidth];
+        }
+
+        //基数木の節と葉をまとめて確保・解放する。SysDequeの配列でも使う
+        //children: この節の子の数, fanout: それより下の節の子の数
+        static void freeRadixNode(SysMem mem, wmptr_t node, size_t level, size_t children, size_t fanout)
+        {
+            if (node == WMPNULL) {
+                return;
+            }
+            if (level > 0) {
+                for (size_t i = 0; i < children; i++) {
+                    freeRadixNode(mem, (wmptr_t)mem->data[node + i], level - 1, fanout, fanout);
+                }
+            }
+            wmfree(mem, node);
+            return;
+        }
+
+        static void freeHashTable(SysMem mem, SysHash h, wmptr_t root, size_t bits, size_t levels)
+        {
+            size_t top = (size_t)1 << (bits - h->slotbits - (levels > 0 ? (levels - 1) * h->dirbits : 0));
+            freeRadixNode(mem, root, levels, top, (size_t)1 << h->dirbits);
+            return;
+        }
+
+        static wmptr_t allocRadixNode(SysMem mem, size_t level, size_t children, size_t fanout)
+        {
+            wmptr_t node = wmalloc(mem);
+            if (node == WMPNULL) {
+                return WMPNULL;
+            }
+
+            if (level == 0) {
+                for (size_t i = 0; i < mem->blocksize; i++) {
+                    mem->data[node + i] = NULL;
+                }
+                return node;
+            }
+
+            //失敗時に解放できるよう先に埋めておく
+            for (size_t i = 0; i < children; i++) {
+                mem->data[node + i] = (Pointer)WMPNULL;
+            }
+            for (size_t i = 0; i < children; i++) {
+                wmptr_t child = allocRadixNode(mem, level - 1, fanout, fanout);
+                if (child == WMPNULL) {
+                    freeRadixNode(mem, node, level, children, fanout);
+                    return WMPNULL;
+                }
+                //wmallocでmem->dataが動くので毎回引き直す
+                mem->data[node + i] = (Pointer)child;
+            }
+            return node;
+        }
+
+        //スロットのブロックは空に、ディレクトリのブロックは子なしにする
+        static void hashClearBlock(SysMem mem, wmptr_t node, int leaf)
+        {
+            Pointer fill = leaf ? NULL : (Pointer)WMPNULL;
+            for (size_t i = 0; i < mem->blocksize; i++) {
+                mem->data[node + i] = fill;
+            }
+            return;
+        }
+
+        //最上位のブロックだけを確保する。その下は最初に書き込むときにhashTouchで確保するので、
+        //拡張しても1回の挿入で初期化するのは1ブロックだけで済む
+        static wmptr_t allocHashTable(SysMem mem, size_t levels)
+        {
+            wmptr_t root = wmalloc(mem);
+            if (root == WMPNULL) {
+                return WMPNULL;
+            }
+            hashClearBlock(mem, root, levels == 0);
+            return root;
+        }
+
+        //i番目のスロットを含むブロックを、途中のディレクトリも含めてなければ確保する
+        static int hashTouch(SysMem mem, SysHash h, wmptr_t root, size_t levels, size_t i)
+        {
+            size_t blk = i >> h->slotbits;
+            wmptr_t node = root;
+            for (size_t l = levels; l > 0; l--) {
+                //wmallocでmem->dataが動くので添字で持つ
+                size_t idx = node + ((blk >> ((l - 1) * h->dirbits)) & (((size_t)1 << h->dirbits) - 1));
+                wmptr_t child = (wmptr_t)mem->data[idx];
+                if (child == WMPNULL) {
+                    child = wmalloc(mem);
+                    if (child == WMPNULL) {
+                        return -1;
+                    }
+                    hashClearBlock(mem, child, l == 1);
+                    mem->data[idx] = (Pointer)child;
+                }
+                node = child;
+            }
+            return 0;
+        }
+
+        //i番目のスロットを含むブロックを返してディレクトリから外す。根のブロックは残す
+        static void hashDropBlock(SysMem mem, SysHash h, wmptr_t root, size_t levels, size_t i)
+        {
+            if (levels == 0) {
+                return;
+            }
+            size_t blk = i >> h->slotbits;
+            size_t dmask = ((size_t)1 << h->dirbits) - 1;
+            wmptr_t node = root;
+            for (size_t l = levels; l > 1; l--) {
+                node = (wmptr_t)mem->data[node + ((blk >> ((l - 1) * h->dirbits)) & dmask)];
+                if (node == WMPNULL) {
+                    return;
+                }
+            }
+            wmptr_t leaf = (wmptr_t)mem->data[node + (blk & dmask)];
+            if (leaf != WMPNULL) {
+                mem->data[node + (blk & dmask)] = (Pointer)WMPNULL;
+                wmfree(mem, leaf);
+            }
+            return;
+        }
+
+        //見つかればスロットの先頭を返し、indexにスロットの番号を格納する。なければNULL
+        static inline Pointer *hashProbe(SysMem mem, SysHash h, wmptr_t root, size_t bits, size_t levels,
+                                         uintptr_t key, size_t *index)
+        {
+            size_t mask = ((size_t)1 << bits) - 1;
+            size_t smask = ((size_t)1 << h->slotbits) - 1;
+            size_t i = hashKey(key, bits);
+            Pointer *slot = hashSlot(mem, h, root, levels, i);
+
+            for (uintptr_t dist = 1; slot != NULL; dist++) {
+                uintptr_t meta = (uintptr_t)slot[0];
+                if (meta < dist) {
+                    //空、またはより貧しい要素に出会ったので存在しない
+                    return NULL;
+                }
+                if ((uintptr_t)slot[1] == key) {
+                    if (index != NULL) {
+                        *index = i;
+                    }
+                    return slot;
+                }
+                i = (i + 1) & mask;
+                slot = (i & smask) ? slot + hash_slotwidth : hashSlot(mem, h, root, levels, i);
+            }
+            //確保されていないブロックは空のスロットと同じ
+            return NULL;
+        }
+
+        //ブロックの確保・解放を跨いだら引き直すこと
+        static inline SysHash hashOf(SysMem mem, SysHash hash)
+        {
+            return (SysHash)&mem->partner->data[(wmptr_t)hash];
+        }
+
+        //新しいテーブルに置く。必要なブロックを確保できなければ何も変えずに-1を返す
+        static int hashPlace(SysMem mem, SysHash hash, uintptr_t key, void *value)
+        {
+            SysHash h = hashOf(mem, hash);
+            size_t mask = ((size_t)1 << h->bits) - 1;
+            size_t smask = ((size_t)1 << h->slotbits) - 1;
+            size_t levels = h->levels;
+            size_t home = hashKey(key, h->bits);
+
+            //ずらした要素が最後に落ち着く空きスロットまでのブロックを先に用意しておく
+            size_t i = home;
+            Pointer *slot = hashSlot(mem, h, h->root, levels, i);
+            while (slot != NULL && slot[0] != NULL) {
+                i = (i + 1) & mask;
+                slot = (i & smask) ? slot + hash_slotwidth : hashSlot(mem, h, h->root, levels, i);
+            }
+            if (slot == NULL) {
+                if (hashTouch(mem, h, h->root, levels, i) != 0) {
+                    return -1;
+                }
+                h = hashOf(mem, hash);
+            }
+
+            i = home;
+            slot = hashSlot(mem, h, h->root, levels, i);
+            uintptr_t meta = 1;
+            for (;;) {
+                uintptr_t smeta = (uintptr_t)slot[0];
+                if (smeta == 0) {
+                    slot[0] = (Pointer)meta;
+                    slot[1] = (Pointer)key;
+                    slot[2] = value;
+                    return 0;
+                }
+                if (smeta < meta) {
+                    //住人のほうが元の位置に近いので場所を譲ってもらう
+                    uintptr_t skey = (uintptr_t)slot[1];
+                    void *svalue = slot[2];
+                    slot[0] = (Pointer)meta;
+                    slot[1] = (Pointer)key;
+                    slot[2] = value;
+                    meta = smeta;
+                    key = skey;
+                    value = svalue;
+                }
+                meta++;
+                i = (i + 1) & mask;
+                slot = (i & smask) ? slot + hash_slotwidth : hashSlot(mem, h, h->root, levels, i);
+            }
+        }
+
+        //後続の要素を前に詰めて削除する(墓標は使わない)
+        static void hashRemoveAt(SysMem mem, SysHash h, wmptr_t root, size_t bits, size_t levels, size_t i)
+        {
+            size_t mask = ((size_t)1 << bits) - 1;
+            size_t smask = ((size_t)1 << h->slotbits) - 1;
+            Pointer *slot = hashSlot(mem, h, root, levels, i);
+
+            for (;;) {
+                i = (i + 1) & mask;
+                Pointer *next = (i & smask) ? slot + hash_slotwidth : hashSlot(mem, h, root, levels, i);
+                if (next == NULL || (uintptr_t)next[0] <= 1) {
+                    slot[0] = NULL;
+                    return;
+                }
+                slot[0] = (Pointer)((uintptr_t)next[0] - 1);
+                slot[1] = next[1];
+                slot[2] = next[2];
+                slot = next;
+            }
+        }
+
+        //旧テーブルからstep個のスロットを移す。
+        //移した要素は前詰めで削除するので、cursolより前は常に空であり
+        //旧テーブルはRobin Hoodの不変条件を保ったまま検索できる。
+        //cursolが通り過ぎたブロックはもう読み書きされないので、その場でSysMemに返す。
+        //新しいテーブルのブロックを確保できなければそこで止め、次の更新操作で続きを行う
+        static int hashMigrate(SysMem mem, SysHash hash, size_t step)
+        {
+            SysHash h = hashOf(mem, hash);
+            if (h->oldroot == WMPNULL) {
+                return 0;
+            }
+
+            size_t oldsize = (size_t)1 << h->oldbits;
+            size_t smask = ((size_t)1 << h->slotbits) - 1;
+            size_t levels = h->oldlevels;
+            Pointer *slot = NULL;   //cursolのスロット。同じブロック内を進む間はディレクトリを辿り直さない
+            while (step > 0 && h->cursol < oldsize) {
+                if (slot == NULL) {
+                    slot = hashSlot(mem, h, h->oldroot, levels, h->cursol);
+                }
+                step--;
+                if (slot == NULL) {
+                    //一度も書き込まれなかったブロックは丸ごと飛ばす
+                    h->cursol = (h->cursol | smask) + 1;
+                    continue;
+                }
+                if (slot[0] != NULL) {
+                    uintptr_t key = (uintptr_t)slot[1];
+                    void *value = slot[2];
+                    //置けなかったときに要素を失わないよう、先に新しいテーブルに置く
+                    if (hashPlace(mem, hash, key, value) != 0) {
+                        return -1;
+                    }
+                    h = hashOf(mem, hash);
+                    hashRemoveAt(mem, h, h->oldroot, h->oldbits, levels, h->cursol);
+                    //hashPlaceのwmallocでmem->dataが動きうるので引き直す
+                    slot = NULL;
+                    continue;
+                }
+                h->cursol++;
+                if ((h->cursol & smask) == 0) {
+                    hashDropBlock(mem, h, h->oldroot, levels, h->cursol - 1);
+                    h = hashOf(mem, hash);
+                    slot = NULL;
+                } else {
+                    slot += hash_slotwidth;
+                }
+            }
+
+            if (h->cursol >= oldsize) {
+                freeHashTable(mem, h, h->oldroot, h->oldbits, levels);
+                h = hashOf(mem, hash);
+                h->oldroot = WMPNULL;
+                h->oldbits = 0;
+                h->oldlevels = 0;
+                h->cursol = 0;
+            }
+            return 0;
+        }
+
+        SysHash initSysHash(SysMem mem)
+        {
+            if (mem == NULL || mem->partner == NULL) {
+                return (SysHash)WMPNULL;
+            }
+            if (mem->blocksize < hash_slotwidth
+                || mem->partner->blocksize * sizeof(Pointer) < sizeof(struct syshash_t)) {
+                return (SysHash)WMPNULL;
+            }
+
+            wmptr_t ptr = complemalloc(mem->partner);
+            if (ptr == WMPNULL) {
+                return (SysHash)WMPNULL;
+            }
+            SysHash h = (SysHash)&mem->partner->data[ptr];
+            h->count = 0;
+            h->slotbits = (unsigned int)floorLog2(mem->blocksize / hash_slotwidth);
+            h->dirbits = (unsigned int)floorLog2(mem->blocksize);
+            //hashKeyは64 - bitsだけシフトするので、ブロックあたり1スロットでも2スロットから始める
+            h->bits = h->slotbits > 0 ? h->slotbits : 1;
+            h->levels = hashLevels(h, h->bits);
+            h->oldbits = 0;
+            h->oldlevels = 0;
+            h->oldroot = WMPNULL;
+            h->cursol = 0;
+            wmptr_t root = allocHashTable(mem, h->levels);
+            if (root == WMPNULL) {
+                complefree(mem->partner, ptr);
+                return (SysHash)WMPNULL;
+            }
+            hashOf(mem, (SysHash)ptr)->root = root;
+
+            //SysStackと同様、partnerのアドレスを返してはならない
+            return (SysHash)ptr;
+        }
+
+        int hashFind(SysMem mem, SysHash hash, uintptr_t key, void **value)
+        {
+            if (mem == NULL || hash == (SysHash)WMPNULL) {
+                return 0;
+            }
+
+            SysHash h = (SysHash)&mem->partner->data[(wmptr_t)hash];
+            Pointer *slot = hashProbe(mem, h, h->root, h->bits, h->levels, key, NULL);
+            if (slot == NULL && h->oldroot != WMPNULL) {
+                slot = hashProbe(mem, h, h->oldroot, h->oldbits, h->oldlevels, key, NULL);
+            }
+            if (slot == NULL) {
+                return 0;
+            }
+
+            if (value != NULL) {
+                *value = slot[2];
+            }
+            return 1;
+        }
+
+        int hashInsert(SysMem mem, SysHash hash, uintptr_t key, void *value)
+        {
+            if (mem == NULL || hash == (SysHash)WMPNULL) {
+                return -1;
+            }
+
+            hashMigrate(mem, hash, hash_migratestep);
+            SysHash h = hashOf(mem, hash);
+
+            //既存のキーは移行せずその場で上書き
+            Pointer *slot = hashProbe(mem, h, h->root, h->bits, h->levels, key, NULL);
+            if (slot == NULL && h->oldroot != WMPNULL) {
+                slot = hashProbe(mem, h, h->oldroot, h->oldbits, h->oldlevels, key, NULL);
+            }
+            if (slot != NULL) {
+                slot[2] = value;
+                return 0;
+            }
+
+            //負荷率7/8で倍に拡張する
+            size_t size = (size_t)1 << h->bits;
+            if (h->count + 1 > size - (size >> 3)) {
+                //移行が終わっていなければ先に済ませる(通常は起こらない)
+                hashMigrate(mem, hash, (size_t)2 << h->oldbits);
+                h = hashOf(mem, hash);
+                if (h->oldroot != WMPNULL) {
+                    return -1;
+                }
+                unsigned int levels = hashLevels(h, h->bits + 1);
+                wmptr_t root = allocHashTable(mem, levels);
+                if (root == WMPNULL) {
+                    return -1;
+                }
+                h = hashOf(mem, hash);
+                h->oldroot = h->root;
+                h->oldbits = h->bits;
+                h->oldlevels = h->levels;
+                h->cursol = 0;
+                h->root = root;
+                h->bits++;
+                h->levels = levels;
+                hashMigrate(mem, hash, hash_migratestep);
+            }
+
+            if (hashPlace(mem, hash, key, value) != 0) {
+                return -1;
+            }
+            hashOf(mem, hash)->count++;
+            return 0;
+        }
+
+        int hashErase(SysMem mem, SysHash hash, uintptr_t key)
+        {
+            if (mem == NULL || hash == (SysHash)WMPNULL) {
+                return 0;
+            }
+
+            hashMigrate(mem, hash, hash_migratestep);
+            SysHash h = hashOf(mem, hash);
+
+            size_t i;
+            if (hashProbe(mem, h, h->root, h->bits, h->levels, key, &i) != NULL) {
+                hashRemoveAt(mem, h, h->root, h->bits, h->levels, i);
+                h->count--;
+                return 1;
+            }
+            if (h->oldroot != WMPNULL) {
+                //cursol以降の要素を詰めるだけなので移行済みの領域は汚さない
+                if (hashProbe(mem, h, h->oldroot, h->oldbits, h->oldlevels, key, &i) != NULL) {
+                    hashRemoveAt(mem, h, h->oldroot, h->oldbits, h->oldlevels, i);
+                    h->count--;
+                    return 1;
+                }
+            }
+            return 0;
+        }
+
+        size_t hashCount(SysMem mem, SysHash hash)
+        {
+            if (mem == NULL || hash == (SysHash)WMPNULL) {
+                return 0;
+            }
+            return ((SysHash)&mem->partner->data[(wmptr_t)hash])->count;
+        }
+
+        void deleteSysHash(SysMem mem, SysHash *hash)
+        {
+            if (mem == NULL || hash == NULL) {
+                return;
+            }
+
+            if (*hash == (SysHash)WMPNULL) {
+                return;
+            }
+
+            SysHash h = hashOf(mem, *hash);
+            wmptr_t oldroot = h->oldroot;
+            size_t oldbits = h->oldbits;
+            size_t oldlevels = h->oldlevels;
+            freeHashTable(mem, h, h->root, h->bits, h->levels);
+            if (oldroot != WMPNULL) {
+                freeHashTable(mem, hashOf(mem, *hash), oldroot, oldbits, oldlevels);
+            }
+            complefree(mem->partner, (wmptr_t)*hash);
+            *hash = (SysHash)WMPNULL;
+
+            return;
+        }
+
+        //SysDeque
+        //Chase-Levのwork-stealing deque。配列は要素ブロックを基数木状のディレクトリで束ねた循環配列で、
+        //満杯になると倍の配列を作って移し替える。退役した配列はまだstealに読まれている可能性があるので
+        //retiredに繋いでおき、steal中のスレッドがいないときにwmfreeでSysMemに返す。
+        //配列はdata[a]から(容量のlog2, 退役リストの次, 基数木の根, ディレクトリの段数)を並べたブロックで表す。
+
+        static const size_t deque_desc = 4;     //配列を表すブロックの要素数
+
+        //wmallocでmem->dataが動きうる間(initSysDeque中)は毎回引き直すこと
+        static inline SysDeque dequeOf(SysMem mem, wmptr_t dq)
+        {
+            return (SysDeque)&mem->data[dq];
+        }
+
+        //ディレクトリの段数。0なら根がそのまま要素ブロック
+        static inline size_t dequeLevels(SysDeque d, size_t bits)
+        {
+            size_t levels = 0;
+            for (size_t b = d->blockbits; b < bits; b += d->blockbits) {
+                levels++;
+            }
+            return levels;
+        }
+
+        static inline Pointer *dequeSlot(SysMem mem, SysDeque d, wmptr_t a, intptr_t i)
+        {
+            size_t j = (size_t)i & (((size_t)1 << (size_t)mem->data[a]) - 1);
+            size_t blk = j >> d->blockbits;
+            size_t mask = ((size_t)1 << d->blockbits) - 1;
+            wmptr_t node = (wmptr_t)mem->data[a + 2];
+            for (size_t l = (size_t)mem->data[a + 3]; l > 0; l--) {
+                node = (wmptr_t)mem->data[node + ((blk >> ((l - 1) * d->blockbits)) & mask)];
+            }
+            return &mem->data[node + (j & mask)];
+        }
+
+        static void freeDequeArray(SysMem mem, SysDeque d, wmptr_t a)
+        {
+            size_t bits = (size_t)mem->data[a];
+            size_t levels = (size_t)mem->data[a + 3];
+            size_t top = (size_t)1 << (bits - d->blockbits - (levels > 0 ? (levels - 1) * d->blockbits : 0));
+            freeRadixNode(mem, (wmptr_t)mem->data[a + 2], levels, top, (size_t)1 << d->blockbits);
+            wmfree(mem, a);
+            return;
+        }
+
+        static wmptr_t allocDequeArray(SysMem mem, wmptr_t dq, size_t bits)
+        {
+            if (bits >= sizeof(size_t) * 8 - 1) {
+                return WMPNULL;
+            }
+
+            wmptr_t a = wmalloc(mem);
+            if (a == WMPNULL) {
+                return WMPNULL;
+            }
+            SysDeque d = dequeOf(mem, dq);
+            size_t levels = dequeLevels(d, bits);
+            size_t top = (size_t)1 << (bits - d->blockbits - (levels > 0 ? (levels - 1) * d->blockbits : 0));
+            wmptr_t root = allocRadixNode(mem, levels, top, (size_t)1 << d->blockbits);
+            if (root == WMPNULL) {
+                wmfree(mem, a);
+                return WMPNULL;
+            }
+            mem->data[a] = (Pointer)bits;
+            mem->data[a + 1] = (Pointer)WMPNULL;
+            mem->data[a + 2] = (Pointer)root;
+            mem->data[a + 3] = (Pointer)levels;
+            return a;
+        }
+
+        //arrayの公開とstealersの読み出しがともにseq_cstなので、ここで0が見えれば
+        //以降のstealは必ず新しい配列を読む
+        static void recycleDeque(SysMem mem, SysDeque d)
+        {
+            if (d->retired == WMPNULL || __atomic_load_n(&d->stealers, __ATOMIC_SEQ_CST) != 0) {
+                return;
+            }
+
+            while (d->retired != WMPNULL) {
+                wmptr_t a = d->retired;
+                d->retired = (wmptr_t)mem->data[a + 1];
+                freeDequeArray(mem, d, a);
+            }
+            return;
+        }
+
+        static wmptr_t growDeque(SysMem mem, SysDeque dq, wmptr_t a, intptr_t t, intptr_t b)
+        {
+            SysDeque d = dequeOf(mem, (wmptr_t)dq);
+            recycleDeque(mem, d);
+
+            wmptr_t na = allocDequeArray(mem, (wmptr_t)dq, (size_t)mem->data[a] + 1);
+            if (na == WMPNULL) {
+                return WMPNULL;
+            }
+            for (intptr_t i = t; i < b; i++) {
+                *dequeSlot(mem, d, na, i) = *dequeSlot(mem, d, a, i);
+            }
+
+            mem->data[a + 1] = (Pointer)d->retired;
+            d->retired = a;
+            __atomic_store_n(&d->array, na, __ATOMIC_SEQ_CST);
+            return na;
+        }
+
+        SysDeque initSysDeque(SysMem mem)
+        {
+            if (mem == NULL || mem->blocksize * sizeof(Pointer) < sizeof(struct sysdeque_t)) {
+                return (SysDeque)WMPNULL;
+            }
+
+            wmptr_t dq = wmalloc(mem);
+            if (dq == WMPNULL) {
+                return (SysDeque)WMPNULL;
+            }
+            SysDeque d = dequeOf(mem, dq);
+            d->bottom = 0;
+            d->top = 0;
+            d->stealers = 0;
+            d->retired = WMPNULL;
+            d->blockbits = floorLog2(mem->blocksize);
+            wmptr_t a = allocDequeArray(mem, dq, d->blockbits);
+            if (a == WMPNULL) {
+                wmfree(mem, dq);
+                return (SysDeque)WMPNULL;
+            }
+            dequeOf(mem, dq)->array = a;
+
+            //stealはロックを取らずにmem->dataを読むので、deleteSysDequeまでreallocさせない
+            pinSysMem(mem);
+            return (SysDeque)dq;
+        }
+
+        int pushDeque(SysMem mem, SysDeque dq, void *p)
+        {
+            if (mem == NULL || dq == (SysDeque)WMPNULL) {
+                return -1;
+            }
+
+            SysDeque d = dequeOf(mem, (wmptr_t)dq);
+            intptr_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+            intptr_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+            wmptr_t a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+            if (b - t > ((intptr_t)1 << (size_t)mem->data[a]) - 1) {
+                a = growDeque(mem, dq, a, t, b);
+                if (a == WMPNULL) {
+                    return -1;
+                }
+            }
+
+            __atomic_store_n(dequeSlot(mem, d, a, b), p, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+
+        int popDeque(SysMem mem, SysDeque dq, void **p)
+        {
+            if (mem == NULL || dq == (SysDeque)WMPNULL) {
+                return 0;
+            }
+
+            SysDeque d = dequeOf(mem, (wmptr_t)dq);
+            intptr_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+            wmptr_t a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+            __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            intptr_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+            if (t > b) {
+                //空
+                __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+                return 0;
+            }
+
+            void *ret = __atomic_load_n(dequeSlot(mem, d, a, b), __ATOMIC_RELAXED);
+            if (t == b) {
+                //最後の1つはstealと取り合う
+                int won = __atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                                      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+                __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+                if (!won) {
+                    return 0;
+                }
+            }
+
+            if (p != NULL) {
+                *p = ret;
+            }
+            return 1;
+        }
+
+        int stealDeque(SysMem mem, SysDeque dq, void **p)
+        {
+            if (mem == NULL || dq == (SysDeque)WMPNULL) {
+                return 0;
+            }
+
+            SysDeque d = dequeOf(mem, (wmptr_t)dq);
+            intptr_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            intptr_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+            if (t >= b) {
+                return 0;
+            }
+
+            //配列を読んでいる間は退役した配列を再利用させない
+            __atomic_add_fetch(&d->stealers, 1, __ATOMIC_SEQ_CST);
+            wmptr_t a = __atomic_load_n(&d->array, __ATOMIC_SEQ_CST);
+            void *ret = __atomic_load_n(dequeSlot(mem, d, a, t), __ATOMIC_RELAXED);
+            int won = __atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                                  __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&d->stealers, 1, __ATOMIC_SEQ_CST);
+            if (!won) {
+                return -1;
+            }
+
+            if (p != NULL) {
+                *p = ret;
+            }
+            return 1;
+        }
+
+        //stealしているスレッドがいないときに呼ぶこと
+        void deleteSysDeque(SysMem mem, SysDeque *dq)
+        {
+            if (mem == NULL || dq == NULL) {
+                return;
+            }
+
+            if (*dq == (SysDeque)WMPNULL) {
+                return;
+            }
+
+            SysDeque d = dequeOf(mem, (wmptr_t)*dq);
+            freeDequeArray(mem, d, d->array);
+            recycleDeque(mem, d);
+            unpinSysMem(mem);
+            wmfree(mem, (wmptr_t)*dq);
+            *dq = (SysDeque)WMPNULL;
+
+            return;
+        }
+
         Block initBlock(SysMem mem)
         {
             Block blk = (Block)complemalloc(mem->partner);
@@ -40,6 +40,14 @@ namespace Wulf {
         typedef struct sysstack_t* SysStack;
         typedef struct block_t* Block;
         typedef struct sysqueue_t* SysQueue;
+        typedef struct syshash_t* SysHash;
+        typedef struct sysdeque_t* SysDeque;
+        typedef struct sysmark_t SysMark;
+        typedef int (*Budget_f)(SysMem mem, size_t committed, size_t limit);
+        //committed: 拡張後のバイト数, limit: 超えたソフトリミット
+        //0以外を返すと拡張を取りやめ、wmallocはWMPNULLを返す
+        //他のSysMemをreset/trimして容量を空けてよい。ただしpinされたSysMem(SysDequeのものや、
+        //dataをmalloc以外で用意したもの)はdataを動かせないので、trimしても何も起きない
 
         struct complemem_t {
             size_t allsize;         //全体の個数
@@ -48,7 +56,8 @@ namespace Wulf {
             wmptr_t last;           //使用可能メモリの末尾+1
             Pointer *data;          //使用可能メモリの先頭
             SysMem partner;
-            SysStack freestack;
+            wmptr_t freelist;       //complefreeされたブロックの連結リスト(ブロックの先頭に次の添字を書く)
+            size_t pincount;        //0でない間はdataを動かさない(拡張もtrimもしない)
         };
 
         struct sysmem_t {
@@ -58,7 +67,15 @@ namespace Wulf {
             wmptr_t last;       //使用可能メモリの末尾+1
             Pointer *data;      //使用可能メモリの先頭
             CompleMem partner;
-            SysStack freestack;
+            wmptr_t freelist;   //wmfreeされたブロックの連結リスト(ブロックの先頭に次の添字を書く)
+            size_t softlimit;   //これを超えて拡張するときsoftfunを呼ぶ(バイト数、0で無制限)
+            size_t hardlimit;   //これを超えては拡張しない(バイト数、0で無制限)
+            Budget_f softfun;
+            size_t pincount;    //0でない間はdataを動かさない(拡張もtrimもしない)
+            size_t generation;  //最後にmarkSysMemで振った番号
+            size_t stalelo;     //(stalelo, stalehi]の番号のmarkはreleaseで無効になっている
+            size_t stalehi;
+            size_t lastrelease; //最後にreleaseしたmarkの番号。区間に含まれても有効
         };
 
         struct sysstack_t {
@@ -82,6 +99,38 @@ namespace Wulf {
             Block lastblk;  //キューの末尾ブロック
         };
 
+        struct sysmark_t {
+            wmptr_t last;       //markした時点のSysMemのlast
+            wmptr_t complelast; //markした時点のCompleMemのlast
+            size_t generation;  //markの番号(1から順に振る)
+        };
+
+        struct syshash_t {
+            size_t count;       //格納されている要素数(旧テーブルの分も含む)
+            size_t bits;        //テーブルのスロット数のlog2
+            wmptr_t root;       //テーブルの最上位ブロックの添字
+            size_t oldbits;     //移行中の旧テーブルのスロット数のlog2
+            wmptr_t oldroot;    //移行中の旧テーブル(移行中でなければWMPNULL)
+            wmptr_t cursol;     //旧テーブルのうち移行を終えたスロット数
+            //CompleMemの既定のブロック(8要素)に収まるよう、以下はunsigned intに詰める
+            unsigned int slotbits;  //ブロックあたりのスロット数のlog2
+            unsigned int dirbits;   //ディレクトリブロックあたりの子の数のlog2
+            unsigned int levels;    //テーブルのディレクトリの段数
+            unsigned int oldlevels; //旧テーブルのディレクトリの段数
+            //スロットは(距離+1, キー, 値)の3要素。距離+1が0なら空
+        };
+
+        //複数スレッドから読まれるため、SysStackと違ってCompleMemではなくSysMemのブロックに置く
+        struct sysdeque_t {
+            intptr_t bottom;    //所有スレッドがpush/popする位置
+            wmptr_t array;      //現在の配列(配列を表すブロックの添字)
+            wmptr_t retired;    //拡張により退役した配列の連結リスト
+            size_t blockbits;   //要素ブロックあたりの要素数とディレクトリの分岐数のlog2
+            intptr_t pad[6];    //retiredとtopの間を64バイト以上空け、dataの配置によらずtopを所有スレッドが書く要素と別のキャッシュラインに置く
+            intptr_t top;       //stealする位置
+            size_t stealers;    //steal中のスレッド数
+        };
+
         extern const size_t complemem_blocksize_default;
 
         Error_f SetErrorFun(Error_f ptr);
@@ -100,9 +149,53 @@ namespace Wulf {
         wmptr_t wmalloc(SysMem mem);
         void wmfree(SysMem mem, wmptr_t p);
         SysMem combine(SysMem mem, CompleMem cmem);
+        void resetCompleMem(CompleMem cmem);
+        void resetSysMem(SysMem mem);
+        //確保済みの容量は保持したまま、すべての領域をO(1)で解放する
+        void trimCompleMem(CompleMem cmem);
+        void trimSysMem(SysMem mem);
+        //使用中の領域を残して確保済みの容量を返却する
+        void setSysMemBudget(SysMem mem, size_t softlimit, size_t hardlimit, Budget_f softfun);
+        void setGlobalBudget(size_t softlimit, size_t hardlimit, Budget_f softfun);
+        //予算の判定はdataを拡張するときだけ行う。globalのsoftfunにはCompleMemの拡張時にはNULLが渡る
+        //グローバルの予算は複数のスレッドから使ってよい(拡張分はCASで予約する)。SysMemごとの予算はそのSysMemと同じスレッドで設定する
+        size_t committedSize(void);
+        //全SysMem/CompleMemで確保済みのバイト数
+        void pinCompleMem(CompleMem cmem);
+        void unpinCompleMem(CompleMem cmem);
+        void pinSysMem(SysMem mem);
+        void unpinSysMem(SysMem mem);
+        //pinした回数だけunpinするまでdataのアドレスを固定する。拡張が必要なwmallocはWMPNULLを返す
+        SysMark markSysMem(SysMem mem);
+        void releaseSysMem(SysMem mem, SysMark mark);
+        //markSysMem以降にSysMemとpartnerで確保した領域をO(1)で解放する。
+        //外側のmarkまでreleaseした後やreset後の古いmarkでは何もしない
         SysStack initSysStack(SysMem mem);
         void *pop(SysMem mem, SysStack stk);
-        void push(SysMem mem, SysStack stk, void *p);
+        int push(SysMem mem, SysStack stk, void *p);
+        //成功で0、領域不足で-1(何も積まない)
         void deleteSysStack(SysMem mem, SysStack *stk);
+        SysHash initSysHash(SysMem mem);
+        //mem->blocksizeは3以上、mem->partner->blocksizeはsyshash_tを格納できる大きさが必要
+        int hashFind(SysMem mem, SysHash hash, uintptr_t key, void **value);
+        //見つかれば1を返し、valueがNULLでなければ値を格納する
+        int hashInsert(SysMem mem, SysHash hash, uintptr_t key, void *value);
+        //既存のキーは値を上書きする。成功で0、領域不足で-1
+        int hashErase(SysMem mem, SysHash hash, uintptr_t key);
+        //削除できれば1を返す
+        size_t hashCount(SysMem mem, SysHash hash);
+        void deleteSysHash(SysMem mem, SysHash *hash);
+        SysDeque initSysDeque(SysMem mem);
+        //work-stealing deque(Chase-Lev)。stealされている間にdataが動かないよう、
+        //deleteSysDequeまでmemをpinする。容量はmemの空きだけで決まる。
+        //memをwmallocするのは所有スレッドだけにすること
+        int pushDeque(SysMem mem, SysDeque dq, void *p);
+        //所有スレッドのみ。成功で0、領域不足で-1
+        int popDeque(SysMem mem, SysDeque dq, void **p);
+        //所有スレッドのみ。取り出せれば1、空なら0
+        int stealDeque(SysMem mem, SysDeque dq, void **p);
+        //任意のスレッド。取り出せれば1、空なら0、他と競合したら-1
+        void deleteSysDeque(SysMem mem, SysDeque *dq);
+        //配列をすべてwmfreeで返し、memのpinを外す
     }
 }
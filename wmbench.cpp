@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <atomic>
+
+#include "wmalloc.h"
+
+#define workers 4
+#define taskcase 2000000
+#define batchmax 1000
+#define stealmax 16
+
+using namespace Wulf::Sys;
+
+//各ワーカーは自分のSysMemとSysDequeを持ち、タスクをまとめてpushしては
+//popで消化する。その合間に常に他のワーカーからstealする。
+//すべてのタスクがちょうど1回ずつ実行されたことを最後に確かめる。
+
+struct worker_t {
+    int id;
+    CompleMem cmem;
+    SysMem mem;
+    SysDeque dq;
+    unsigned int seed;
+    long steals;
+    long inlined;
+};
+
+static struct worker_t worker[workers];
+static std::atomic<unsigned char> *seen;
+static std::atomic<long> done(0);
+static std::atomic<long> duplicates(0);
+
+static void runTask(uintptr_t task)
+{
+    if (seen[task].fetch_add(1) != 0) {
+        duplicates++;
+    }
+    done++;
+}
+
+static void *workerMain(void *arg)
+{
+    struct worker_t *w = (struct worker_t *)arg;
+    uintptr_t next = (uintptr_t)w->id * (taskcase / workers);
+    uintptr_t end = next + taskcase / workers;
+    void *task;
+
+    while (done.load() < taskcase) {
+        if (next < end) {
+            //拡張と縮小を繰り返させるためバッチの大きさはばらつかせる
+            int batch = rand_r(&w->seed) % batchmax + 1;
+            for (int i = 0; i < batch && next < end; i++, next++) {
+                if (pushDeque(w->mem, w->dq, (void *)next) != 0) {
+                    //dequeが満杯なのでその場で実行する
+                    runTask(next);
+                    w->inlined++;
+                }
+            }
+        }
+
+        //生成中は一部だけ消化し、残りを他のワーカーにstealさせる
+        int quota = next < end ? rand_r(&w->seed) % batchmax : batchmax;
+        while (quota-- > 0 && popDeque(w->mem, w->dq, &task)) {
+            runTask((uintptr_t)task);
+        }
+
+        //生成中も含めて毎回stealを試み、拡張・再利用とstealを並行させる
+        for (int i = 0; i < stealmax; i++) {
+            struct worker_t *victim = &worker[rand_r(&w->seed) % workers];
+            if (victim != w && stealDeque(victim->mem, victim->dq, &task) == 1) {
+                runTask((uintptr_t)task);
+                w->steals++;
+            }
+        }
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    seen = new std::atomic<unsigned char>[taskcase];
+    for (int i = 0; i < taskcase; i++) {
+        seen[i] = 0;
+    }
+
+    for (int i = 0; i < workers; i++) {
+        worker[i].id = i;
+        worker[i].cmem = initCompleMem(1, 16, complemem_blocksize_default);
+        worker[i].mem = combine(initSysMem(64, 16, 64), worker[i].cmem);
+        if (worker[i].mem == NULL) {
+            puts("mem is NULL.");
+            return EXIT_FAILURE;
+        }
+        worker[i].dq = initSysDeque(worker[i].mem);
+        if (worker[i].dq == (SysDeque)WMPNULL) {
+            puts("dq is WMPNULL.");
+            return EXIT_FAILURE;
+        }
+        worker[i].seed = i + 1;
+        worker[i].steals = 0;
+        worker[i].inlined = 0;
+    }
+
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t th[workers];
+    for (int i = 0; i < workers; i++) {
+        pthread_create(&th[i], NULL, workerMain, &worker[i]);
+    }
+    for (int i = 0; i < workers; i++) {
+        pthread_join(th[i], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double sec = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) * 1e-9;
+
+    long missing = 0;
+    for (int i = 0; i < taskcase; i++) {
+        if (seen[i] == 0) {
+            missing++;
+        }
+    }
+
+    long steals = 0, inlined = 0;
+    for (int i = 0; i < workers; i++) {
+        steals += worker[i].steals;
+        inlined += worker[i].inlined;
+        deleteSysDeque(worker[i].mem, &worker[i].dq);
+        deleteCompleMem(&worker[i].cmem);
+        deleteSysMem(&worker[i].mem);
+    }
+    delete[] seen;
+
+    printf("%d workers: %ld tasks in %fs (%.0f tasks/s), %ld steals, %ld inlined\n",
+           workers, done.load(), sec, done.load() / sec, steals, inlined);
+    if (missing != 0 || duplicates != 0) {
+        printf("missing: %ld, duplicates: %ld\n", missing, duplicates.load());
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
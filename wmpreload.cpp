@@ -0,0 +1,481 @@
+/****************************************************************************/
+/*                  Copyright 2014-2015 Yoshinobu Ogura                     */
+/*                                                                          */
+/*                      This file is part of Sirius.                        */
+/*                                                                          */
+/*  Sirius is free software: you can redistribute it and/or modify          */
+/*  it under the terms of the GNU General Public License as published by    */
+/*  the Free Software Foundation, either version 3 of the License, or       */
+/*  (at your option) any later version.                                     */
+/*                                                                          */
+/*  Sirius is distributed in the hope that it will be useful,               */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/*  GNU General Public License for more details.                            */
+/*                                                                          */
+/*  You should have received a copy of the GNU General Public License       */
+/*  along with Sirius.  If not, see <http://www.gnu.org/licenses/>.         */
+/*                                                                          */
+/****************************************************************************/
+
+//LD_PRELOADでmalloc/free/calloc/reallocを横取りし、
+//WMALLOC_HOT_SIZESで指定した大きさ以下の要求をサイズごとのSysMemから割り当てる。
+//それ以外はlibcのmallocに回す。
+//
+//  LD_PRELOAD=./libwmpreload.so WMALLOC_HOT_SIZES=16,32,64 ./a.out
+//
+//各SysMemのdataは1つのmmap領域を等分したもので、pinSysMemで固定して
+//reallocされない(アドレスが動かない)ようにしている。
+//満杯になったSysMemの分はlibcに回す。
+//freeでは領域の先頭からの距離で所有するSysMemをO(1)で求める。
+//各スレッドはSysMemごとにfreeされたブロックをキャッシュし、空になったときと
+//たまりすぎたときだけロックを取ってまとめてSysMemとやり取りする。
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <string.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <atomic>
+
+#include "wmalloc.h"
+
+using namespace Wulf::Sys;
+
+typedef void *(*Malloc_f)(size_t);
+typedef void (*Free_f)(void *);
+typedef void *(*Calloc_f)(size_t, size_t);
+typedef void *(*Realloc_f)(void *, size_t);
+typedef size_t (*UsableSize_f)(void *);
+
+struct wmpool_t {
+    struct sysmem_t mem;    //dataはmmap領域の一部
+    size_t size;            //割り当てる大きさ(バイト)
+    pthread_mutex_t lock;
+};
+
+static const size_t wmpool_max = 16;
+static const size_t wmpool_align = 16;                 //mallocが保証するアラインメント
+static const size_t wmpool_maxsize = 1024;             //横取りする大きさの上限
+static const size_t wmpool_bytes_default = 64 << 20;   //SysMemあたりの領域
+static const size_t wmcache_max = 64;                  //スレッドがSysMemごとにためておくブロック数の上限
+static const size_t wmcache_batch = 32;                //1回のロックでSysMemとやり取りするブロック数
+
+//スレッドごとのキャッシュ。ブロックの先頭に次のブロックのアドレスを書いて繋ぐ
+struct wmcache_t {
+    void *head;
+    size_t count;
+};
+
+static struct wmpool_t pools[wmpool_max];
+static size_t poolnum = 0;
+static size_t poolbytes = 0;
+static char *poolbase = NULL;
+static char *poolend = NULL;
+//(size + wmpool_align - 1) / wmpool_alignからpoolsの添字を引く。-1ならlibcに回す
+static signed char poolclass[wmpool_maxsize / wmpool_align + 1];
+
+static Malloc_f real_malloc = NULL;
+static Free_f real_free = NULL;
+static Calloc_f real_calloc = NULL;
+static Realloc_f real_realloc = NULL;
+static UsableSize_f real_usable_size = NULL;
+
+//dlsymの中でcallocが呼ばれるので、解決が済むまではここから割り当てる
+static char bootbuf[4096] __attribute__((aligned(16)));
+static size_t bootlast = 0;
+
+//TLSはinitial-execにして、__tls_get_addr(その中でmallocしうる)を経由しないようにする
+static std::atomic<int> initdone(0);
+static __thread int initializing __attribute__((tls_model("initial-exec"))) = 0;   //初期化中のスレッドだけがbootbufを使う
+static pthread_mutex_t initlock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct wmcache_t caches[wmpool_max] __attribute__((tls_model("initial-exec")));
+//0: 未登録, 1: キャッシュを使う, 2: 使わない(スレッドの終了処理後やキーを作れなかったとき)
+static __thread int cachestate __attribute__((tls_model("initial-exec"))) = 0;
+static pthread_key_t cachekey;
+static int cachekeyok = 0;
+
+static void *bootAlloc(size_t size)
+{
+    size = (size + wmpool_align - 1) & ~(wmpool_align - 1);
+    if (bootlast + size > sizeof(bootbuf)) {
+        return NULL;
+    }
+    void *ret = &bootbuf[bootlast];
+    bootlast += size;
+    return ret;
+}
+
+static int isBoot(void *p)
+{
+    return (char *)p >= bootbuf && (char *)p < bootbuf + sizeof(bootbuf);
+}
+
+static void parseHotSizes(const char *env)
+{
+    size_t sizes[wmpool_max];
+    size_t n = 0;
+
+    while (env != NULL && *env != '\0' && n < wmpool_max) {
+        char *end;
+        unsigned long v = strtoul(env, &end, 10);
+        if (end == env) {
+            break;
+        }
+        env = (*end == ',') ? end + 1 : end;
+        v = (v + wmpool_align - 1) & ~(wmpool_align - 1);
+        if (v == 0 || v > wmpool_maxsize) {
+            continue;
+        }
+
+        //昇順に挿入し、重複は捨てる
+        size_t i = 0;
+        while (i < n && sizes[i] < v) {
+            i++;
+        }
+        if (i < n && sizes[i] == v) {
+            continue;
+        }
+        memmove(&sizes[i + 1], &sizes[i], (n - i) * sizeof(size_t));
+        sizes[i] = v;
+        n++;
+    }
+
+    memset(poolclass, -1, sizeof(poolclass));
+    for (size_t i = 0, c = 1; i < n; i++) {
+        for (; c <= sizes[i] / wmpool_align; c++) {
+            poolclass[c] = (signed char)i;
+        }
+        pools[i].size = sizes[i];
+    }
+    //malloc(0)も最小のSysMemから割り当てる
+    poolclass[0] = n > 0 ? 0 : -1;
+    poolnum = n;
+    return;
+}
+
+static void initPools(void)
+{
+    const char *env = getenv("WMALLOC_POOL_BYTES");
+    poolbytes = env != NULL ? strtoul(env, NULL, 10) : 0;
+    if (poolbytes == 0) {
+        poolbytes = wmpool_bytes_default;
+    }
+    poolbytes = (poolbytes + 4095) & ~(size_t)4095;
+
+    parseHotSizes(getenv("WMALLOC_HOT_SIZES"));
+    if (poolnum == 0) {
+        return;
+    }
+
+    void *base = mmap(NULL, poolnum * poolbytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        poolnum = 0;
+        memset(poolclass, -1, sizeof(poolclass));
+        return;
+    }
+
+    for (size_t i = 0; i < poolnum; i++) {
+        SysMem mem = &pools[i].mem;
+        mem->blocksize = pools[i].size / sizeof(Pointer);
+        mem->allsize = poolbytes / sizeof(Pointer);
+        mem->pagesize = mem->blocksize;
+        mem->last = 0;
+        mem->data = (Pointer *)((char *)base + i * poolbytes);
+        mem->partner = NULL;
+        mem->freelist = WMPNULL;
+        //dataはmmap領域の一部なのでreallocさせない(拡張もtrimもしない)。満杯になればwmallocはWMPNULLを返す
+        setSysMemBudget(mem, 0, 0, NULL);
+        mem->pincount = 0;
+        pinSysMem(mem);
+        pthread_mutex_init(&pools[i].lock, NULL);
+    }
+    poolbase = (char *)base;
+    poolend = poolbase + poolnum * poolbytes;
+    return;
+}
+
+//キャッシュのブロックをkeep個になるまでSysMemに返す
+static void poolFlush(struct wmpool_t *pool, struct wmcache_t *cache, size_t keep)
+{
+    SysMem mem = &pool->mem;
+    if (cache->count <= keep) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (cache->count > keep) {
+        void *p = cache->head;
+        cache->head = *(void **)p;
+        cache->count--;
+        wmfree(mem, (wmptr_t)((Pointer *)p - mem->data));
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return;
+}
+
+//スレッドの終了時にキャッシュをSysMemに返す。この後のmalloc/freeはキャッシュを通さない
+static void cacheDetach(void *arg)
+{
+    (void)arg;
+    cachestate = 2;
+    for (size_t i = 0; i < poolnum; i++) {
+        poolFlush(&pools[i], &caches[i], 0);
+    }
+    return;
+}
+
+//fork中に他のスレッドがロックを持ったままにならないよう、すべてのロックを取ってからforkする
+static void forkPrepare(void)
+{
+    pthread_mutex_lock(&initlock);
+    for (size_t i = 0; i < poolnum; i++) {
+        pthread_mutex_lock(&pools[i].lock);
+    }
+    return;
+}
+
+static void forkParent(void)
+{
+    for (size_t i = poolnum; i > 0; i--) {
+        pthread_mutex_unlock(&pools[i - 1].lock);
+    }
+    pthread_mutex_unlock(&initlock);
+    return;
+}
+
+//子プロセスにはforkしたスレッドしかいないので、ロックは作り直す
+static void forkChild(void)
+{
+    for (size_t i = 0; i < poolnum; i++) {
+        pthread_mutex_init(&pools[i].lock, NULL);
+    }
+    pthread_mutex_init(&initlock, NULL);
+    return;
+}
+
+static void initPreload(void)
+{
+    pthread_mutex_lock(&initlock);
+    if (initdone.load() == 0) {
+        initializing = 1;
+        real_malloc = (Malloc_f)dlsym(RTLD_NEXT, "malloc");
+        real_free = (Free_f)dlsym(RTLD_NEXT, "free");
+        real_calloc = (Calloc_f)dlsym(RTLD_NEXT, "calloc");
+        real_realloc = (Realloc_f)dlsym(RTLD_NEXT, "realloc");
+        real_usable_size = (UsableSize_f)dlsym(RTLD_NEXT, "malloc_usable_size");
+        initPools();
+        cachekeyok = pthread_key_create(&cachekey, cacheDetach) == 0;
+        pthread_atfork(forkPrepare, forkParent, forkChild);
+        initializing = 0;
+        initdone.store(1, std::memory_order_release);
+    }
+    pthread_mutex_unlock(&initlock);
+    return;
+}
+
+static inline struct wmpool_t *ownerPool(void *p)
+{
+    if ((char *)p < poolbase || (char *)p >= poolend) {
+        return NULL;
+    }
+    return &pools[((char *)p - poolbase) / poolbytes];
+}
+
+//スレッドの終了時にcacheDetachが呼ばれるよう、最初にプールを使うときに登録する
+static int cacheAttach(void)
+{
+    if (cachestate == 0) {
+        //pthread_setspecificの中でmallocされても再帰しないよう先に状態を変えておく
+        cachestate = 2;
+        if (cachekeyok && pthread_setspecific(cachekey, (void *)1) == 0) {
+            cachestate = 1;
+        }
+    }
+    return cachestate == 1;
+}
+
+//キャッシュが空のときだけロックを取り、まとめて割り当てる
+static void *poolRefill(struct wmpool_t *pool, struct wmcache_t *cache)
+{
+    SysMem mem = &pool->mem;
+    size_t n = cacheAttach() ? wmcache_batch : 1;
+    void *ret = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    for (size_t i = 0; i < n; i++) {
+        wmptr_t p = wmalloc(mem);
+        if (p == WMPNULL) {
+            break;
+        }
+        void *block = &mem->data[p];
+        if (ret == NULL) {
+            ret = block;
+            continue;
+        }
+        *(void **)block = cache->head;
+        cache->head = block;
+        cache->count++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+static inline void *poolAlloc(struct wmpool_t *pool)
+{
+    struct wmcache_t *cache = &caches[pool - pools];
+    void *p = cache->head;
+
+    if (p == NULL) {
+        return poolRefill(pool, cache);
+    }
+    cache->head = *(void **)p;
+    cache->count--;
+    return p;
+}
+
+//他のスレッドが割り当てたブロックも、freeしたスレッドのキャッシュに入れる
+static inline void poolFree(struct wmpool_t *pool, void *p)
+{
+    struct wmcache_t *cache = &caches[pool - pools];
+
+    *(void **)p = cache->head;
+    cache->head = p;
+    cache->count++;
+    if (cache->count > wmcache_max || cachestate != 1) {
+        poolFlush(pool, cache, cacheAttach() ? wmcache_max - wmcache_batch : 0);
+    }
+    return;
+}
+
+static inline struct wmpool_t *hotPool(size_t size)
+{
+    if (size > wmpool_maxsize) {
+        return NULL;
+    }
+    int c = poolclass[(size + wmpool_align - 1) / wmpool_align];
+    return c < 0 ? NULL : &pools[c];
+}
+
+extern "C" {
+
+void *malloc(size_t size) __THROW
+{
+    if (initdone.load(std::memory_order_acquire) == 0) {
+        if (initializing) {
+            return bootAlloc(size);
+        }
+        initPreload();
+    }
+
+    struct wmpool_t *pool = hotPool(size);
+    if (pool != NULL) {
+        void *ret = poolAlloc(pool);
+        if (ret != NULL) {
+            return ret;
+        }
+    }
+    return (*real_malloc)(size);
+}
+
+void free(void *p) __THROW
+{
+    if (p == NULL || isBoot(p)) {
+        return;
+    }
+
+    struct wmpool_t *pool = ownerPool(p);
+    if (pool != NULL) {
+        poolFree(pool, p);
+        return;
+    }
+    if (initdone.load(std::memory_order_acquire) == 0) {
+        initPreload();
+    }
+    (*real_free)(p);
+}
+
+void *calloc(size_t n, size_t size) __THROW
+{
+    if (initdone.load(std::memory_order_acquire) == 0) {
+        if (initializing) {
+            //bootbufは0で初期化されている
+            return bootAlloc(n * size);
+        }
+        initPreload();
+    }
+
+    if (size != 0 && n > SIZE_MAX / size) {
+        return NULL;
+    }
+
+    struct wmpool_t *pool = hotPool(n * size);
+    if (pool != NULL) {
+        void *ret = poolAlloc(pool);
+        if (ret != NULL) {
+            memset(ret, 0, n * size);
+            return ret;
+        }
+    }
+    return (*real_calloc)(n, size);
+}
+
+void *realloc(void *p, size_t size) __THROW
+{
+    if (p == NULL) {
+        return malloc(size);
+    }
+
+    struct wmpool_t *pool = ownerPool(p);
+    size_t oldsize;
+    if (pool != NULL) {
+        oldsize = pool->size;
+    } else if (isBoot(p)) {
+        oldsize = bootbuf + sizeof(bootbuf) - (char *)p;
+    } else {
+        if (initdone.load(std::memory_order_acquire) == 0) {
+            initPreload();
+        }
+        return (*real_realloc)(p, size);
+    }
+
+    if (size == 0) {
+        free(p);
+        return NULL;
+    }
+    if (pool != NULL && size <= oldsize) {
+        return p;
+    }
+
+    void *ret = malloc(size);
+    if (ret == NULL) {
+        return NULL;
+    }
+    memcpy(ret, p, size < oldsize ? size : oldsize);
+    free(p);
+    return ret;
+}
+
+size_t malloc_usable_size(void *p) __THROW
+{
+    if (p == NULL || isBoot(p)) {
+        return 0;
+    }
+
+    struct wmpool_t *pool = ownerPool(p);
+    if (pool != NULL) {
+        return pool->size;
+    }
+    if (initdone.load(std::memory_order_acquire) == 0) {
+        initPreload();
+    }
+    return (*real_usable_size)(p);
+}
+
+}
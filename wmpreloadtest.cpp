@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+//libwmpreload.soをLD_PRELOADして動かす。wmalloc.cppはリンクしない。
+//
+//  basic    WMALLOC_HOT_SIZES=16,32,64
+//  fallback WMALLOC_HOT_SIZES=32 WMALLOC_POOL_BYTES=4096
+//  threads  WMALLOC_HOT_SIZES=16,32,64
+
+#define threadnum 4
+#define threadcase 200000
+#define slotnum 256
+#define fallbackcase 1000
+
+static void fill(unsigned char *p, size_t size, unsigned char seed)
+{
+    for (size_t i = 0; i < size; i++) {
+        p[i] = (unsigned char)(seed + i);
+    }
+    return;
+}
+
+static int check(const unsigned char *p, size_t size, unsigned char seed)
+{
+    for (size_t i = 0; i < size; i++) {
+        if (p[i] != (unsigned char)(seed + i)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int testBasic(void)
+{
+    //横取りされていればプールの大きさに切り上げられる
+    unsigned char *p = (unsigned char *)malloc(20);
+    if (p == NULL || malloc_usable_size(p) != 32) {
+        printf("malloc(20): usable %lu\n", (unsigned long)malloc_usable_size(p));
+        return -1;
+    }
+    fill(p, 20, 1);
+
+    //freeしたブロックはすぐに再利用される
+    free(p);
+    unsigned char *q = (unsigned char *)malloc(32);
+    if (q != p) {
+        puts("freed block was not reused.");
+        return -1;
+    }
+
+    //プール内で縮めるときはその場で返す
+    fill(q, 32, 2);
+    p = (unsigned char *)realloc(q, 8);
+    if (p != q) {
+        puts("shrinking realloc moved.");
+        return -1;
+    }
+
+    //大きくするときは上のプールに移して中身を写す
+    p = (unsigned char *)realloc(p, 48);
+    if (p == NULL || malloc_usable_size(p) != 64 || check(p, 32, 2) != 0) {
+        puts("realloc(48) failed.");
+        return -1;
+    }
+
+    //プールより大きければlibcに回す
+    q = (unsigned char *)realloc(p, 4096);
+    if (q == NULL || malloc_usable_size(q) < 4096 || check(q, 32, 2) != 0) {
+        puts("realloc(4096) failed.");
+        return -1;
+    }
+    free(q);
+
+    unsigned char *z = (unsigned char *)calloc(4, 8);
+    if (z == NULL || malloc_usable_size(z) != 32) {
+        puts("calloc(4, 8) failed.");
+        return -1;
+    }
+    for (int i = 0; i < 32; i++) {
+        if (z[i] != 0) {
+            puts("calloc did not clear.");
+            return -1;
+        }
+    }
+    free(z);
+
+    volatile size_t huge = SIZE_MAX / 2;
+    if (calloc(huge, 4) != NULL) {
+        puts("calloc overflow was not detected.");
+        return -1;
+    }
+    if (realloc(malloc(16), 0) != NULL) {
+        puts("realloc(p, 0) did not free.");
+        return -1;
+    }
+    free(NULL);
+
+    puts("basic: ok");
+    return 0;
+}
+
+static void *exitMain(void *arg)
+{
+    unsigned char *p[64];
+    (void)arg;
+    for (int i = 0; i < 64; i++) {
+        p[i] = (unsigned char *)malloc(32);
+    }
+    for (int i = 0; i < 64; i++) {
+        free(p[i]);
+    }
+    return NULL;
+}
+
+//プールが満杯になればlibcに回し、空けばまたプールから割り当てる
+int testFallback(void)
+{
+    static unsigned char *p[fallbackcase];
+    int pooled = 0;
+    int i;
+
+    for (i = 0; i < fallbackcase; i++) {
+        p[i] = (unsigned char *)malloc(32);
+        if (p[i] == NULL) {
+            puts("malloc failed.");
+            return -1;
+        }
+        fill(p[i], 32, (unsigned char)i);
+        if (malloc_usable_size(p[i]) == 32) {
+            pooled++;
+        }
+    }
+    //4096バイトのプールには32バイトのブロックが高々128個しか入らない
+    if (pooled == 0 || pooled > 4096 / 32) {
+        printf("pooled: %d\n", pooled);
+        return -1;
+    }
+
+    for (i = 0; i < fallbackcase; i++) {
+        if (check(p[i], 32, (unsigned char)i) != 0) {
+            printf("corrupted: %d\n", i);
+            return -1;
+        }
+        free(p[i]);
+    }
+
+    unsigned char *q = (unsigned char *)malloc(32);
+    if (malloc_usable_size(q) != 32) {
+        puts("pool was not reused after free.");
+        return -1;
+    }
+    free(q);
+
+    //終了したスレッドがキャッシュしていたブロックはプールに戻る
+    for (i = 0; i < fallbackcase; i++) {
+        pthread_t th;
+        pthread_create(&th, NULL, exitMain, NULL);
+        pthread_join(th, NULL);
+    }
+    for (i = 0; i < 64; i++) {
+        p[i] = (unsigned char *)malloc(32);
+        if (malloc_usable_size(p[i]) != 32) {
+            printf("thread caches were not returned: %d\n", i);
+            return -1;
+        }
+    }
+    for (i = 0; i < 64; i++) {
+        free(p[i]);
+    }
+
+    printf("fallback: %d of %d from the pool\n", pooled, fallbackcase);
+    return 0;
+}
+
+struct slot_t {
+    unsigned char *p;
+    size_t size;
+};
+
+static struct slot_t handoff[threadnum][slotnum];
+
+static void *threadMain(void *arg)
+{
+    intptr_t id = (intptr_t)arg;
+    struct slot_t *slot = handoff[id];
+    unsigned int seed = (unsigned int)id + 1;
+
+    for (int i = 0; i < threadcase; i++) {
+        struct slot_t *s = &slot[rand_r(&seed) % slotnum];
+        if (s->p != NULL) {
+            if (check(s->p, s->size, (unsigned char)s->size) != 0) {
+                return (void *)-1;
+            }
+            free(s->p);
+        }
+
+        s->size = rand_r(&seed) % 128;
+        switch (rand_r(&seed) % 3) {
+        case 0:
+            s->p = (unsigned char *)malloc(s->size);
+            break;
+        case 1:
+            s->p = (unsigned char *)calloc(1, s->size);
+            break;
+        default:
+            s->p = (unsigned char *)realloc(malloc(16), s->size);
+            break;
+        }
+        if (s->p == NULL && s->size != 0) {
+            return (void *)-1;
+        }
+        fill(s->p, s->size, (unsigned char)s->size);
+    }
+    return NULL;
+}
+
+//他のスレッドが割り当てている最中にforkしても、子プロセスでmallocできる
+static int forkDuringThreads(void)
+{
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        void *p = malloc(32);
+        free(p);
+        _exit(p != NULL ? 0 : 1);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int testThreads(void)
+{
+    pthread_t th[threadnum];
+    intptr_t i;
+
+    for (i = 0; i < threadnum; i++) {
+        pthread_create(&th[i], NULL, threadMain, (void *)i);
+    }
+    for (i = 0; i < 8; i++) {
+        if (forkDuringThreads() != 0) {
+            puts("fork failed.");
+            return -1;
+        }
+    }
+    int failed = 0;
+    for (i = 0; i < threadnum; i++) {
+        void *ret;
+        pthread_join(th[i], &ret);
+        if (ret != NULL) {
+            failed++;
+        }
+    }
+    if (failed != 0) {
+        printf("threads: %d corrupted\n", failed);
+        return -1;
+    }
+
+    //他のスレッドが割り当てたブロックをここで解放する
+    for (i = 0; i < threadnum; i++) {
+        for (int j = 0; j < slotnum; j++) {
+            struct slot_t *s = &handoff[i][j];
+            if (s->p != NULL && check(s->p, s->size, (unsigned char)s->size) != 0) {
+                puts("handoff corrupted.");
+                return -1;
+            }
+            free(s->p);
+        }
+    }
+
+    printf("threads: %d threads x %d operations\n", threadnum, threadcase);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *mode = argc > 1 ? argv[1] : "basic";
+    int ret;
+
+    if (strcmp(mode, "basic") == 0) {
+        ret = testBasic();
+    } else if (strcmp(mode, "fallback") == 0) {
+        ret = testFallback();
+    } else if (strcmp(mode, "threads") == 0) {
+        ret = testThreads();
+    } else {
+        printf("unknown mode: %s\n", mode);
+        return EXIT_FAILURE;
+    }
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
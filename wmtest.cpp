@@ -1,13 +1,465 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <unordered_map>
 
 #include "wmalloc.h"
 
 #define testcase 20000
+#define hashcase 1000000
 
 using namespace Wulf::Sys;
 
+//削除したハッシュ表のブロックが再利用されることを確かめる
+int testHashReuse(SysMem mem)
+{
+    wmptr_t last = 0;
+    int round;
+    for (round = 0; round < 3; round++) {
+        SysHash hash = initSysHash(mem);
+        uintptr_t i;
+        for (i = 0; i < hashcase / 10; i++) {
+            if (hashInsert(mem, hash, i, (void *)i) != 0) {
+                puts("hashInsert failed.");
+                return -1;
+            }
+        }
+        deleteSysHash(mem, &hash);
+        if (round == 0) {
+            last = mem->last;
+        } else if (mem->last != last) {
+            printf("SysHash leaked: %lu -> %lu\n", (unsigned long)last, (unsigned long)mem->last);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//ブロックあたり1スロットしか入らない最小のブロックサイズでも動くことを確かめる
+int testHashSmallBlock(void)
+{
+    CompleMem cmem = initCompleMem(1, 16, complemem_blocksize_default);
+    SysMem mem = combine(initSysMem(1, 16, 3), cmem);
+    SysHash hash = initSysHash(mem);
+    if (hash == (SysHash)WMPNULL) {
+        puts("hash is WMPNULL.");
+        return -1;
+    }
+
+    uintptr_t i;
+    for (i = 0; i < 1000; i++) {
+        hashInsert(mem, hash, i, (void *)i);
+    }
+    for (i = 0; i < 1000; i++) {
+        void *value;
+        if (!hashFind(mem, hash, i, &value) || value != (void *)i) {
+            printf("hashFind mismatch: %lu\n", (unsigned long)i);
+            return -1;
+        }
+    }
+
+    deleteSysHash(mem, &hash);
+    deleteCompleMem(&cmem);
+    deleteSysMem(&mem);
+    return 0;
+}
+
+//連番ではなく散らばったキーで比較する
+uintptr_t hashcaseKey(uintptr_t i)
+{
+    return (uintptr_t)(i * 0x9E3779B97F4A7C15ULL);
+}
+
+int testHash(SysMem mem)
+{
+    SysHash hash = initSysHash(mem);
+    if (hash == (SysHash)WMPNULL) {
+        puts("hash is WMPNULL.");
+        return -1;
+    }
+
+    //拡張をまたいでも、1回の挿入で確保するブロックは書き込む経路の分だけ
+    wmptr_t maxgrow = 0;
+    uintptr_t i;
+    for (i = 0; i < hashcase; i++) {
+        wmptr_t last = mem->last;
+        if (hashInsert(mem, hash, hashcaseKey(i), (void *)i) != 0) {
+            puts("hashInsert failed.");
+            return -1;
+        }
+        if (mem->last > last && mem->last - last > maxgrow) {
+            maxgrow = mem->last - last;
+        }
+    }
+    if (maxgrow > 32) {
+        printf("hashInsert allocated %lu blocks at once\n", (unsigned long)maxgrow);
+        return -1;
+    }
+
+    //半分を削除し、残りが引けることを確認する
+    for (i = 0; i < hashcase; i += 2) {
+        if (hashErase(mem, hash, hashcaseKey(i)) != 1) {
+            printf("hashErase failed: %lu\n", (unsigned long)i);
+            return -1;
+        }
+    }
+    if (hashCount(mem, hash) != hashcase / 2) {
+        printf("hashCount mismatch: %lu\n", (unsigned long)hashCount(mem, hash));
+        return -1;
+    }
+    for (i = 0; i < hashcase; i++) {
+        void *value;
+        int found = hashFind(mem, hash, hashcaseKey(i), &value);
+        if (found != (int)(i & 1) || (found && value != (void *)i)) {
+            printf("hashFind mismatch: %lu\n", (unsigned long)i);
+            return -1;
+        }
+    }
+
+    //検索のスループットをstd::unordered_mapと比べる
+    std::unordered_map<uintptr_t, void *> umap;
+    for (i = 1; i < hashcase; i += 2) {
+        umap[hashcaseKey(i)] = (void *)i;
+    }
+
+    //挿入順に引くとunordered_mapのノードが連続して有利なので順番を散らす
+    uintptr_t sum = 0;
+    clock_t start = clock();
+    for (i = 0; i < hashcase; i++) {
+        void *value;
+        if (hashFind(mem, hash, hashcaseKey(i * 7919 % hashcase), &value)) {
+            sum += (uintptr_t)value;
+        }
+    }
+    double hashtime = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (i = 0; i < hashcase; i++) {
+        std::unordered_map<uintptr_t, void *>::iterator it = umap.find(hashcaseKey(i * 7919 % hashcase));
+        if (it != umap.end()) {
+            sum -= (uintptr_t)it->second;
+        }
+    }
+    double umaptime = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("SysHash find: %fs, unordered_map find: %fs\n", hashtime, umaptime);
+    deleteSysHash(mem, &hash);
+    return sum == 0 ? 0 : -1;
+}
+
+int testArena(void)
+{
+    CompleMem cmem = initCompleMem(1, 16, complemem_blocksize_default);
+    SysMem mem = combine(initSysMem(1, 16, 32), cmem);
+    if (mem == NULL) {
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < testcase; i++) {
+        wmalloc(mem);
+    }
+    size_t allsize = mem->allsize;
+
+    //入れ子のmark/release。SysMemもCompleMemも拡張させる
+    SysMark outer = markSysMem(mem);
+    wmptr_t first = wmalloc(mem);
+    complemalloc(cmem);
+    SysMark inner = markSysMem(mem);
+    for (i = 0; i < testcase; i++) {
+        wmalloc(mem);
+        complemalloc(cmem);
+    }
+    releaseSysMem(mem, inner);
+    if (mem->last != inner.last || cmem->last != inner.complelast) {
+        puts("releaseSysMem(inner) failed.");
+        return -1;
+    }
+    releaseSysMem(mem, outer);
+    releaseSysMem(mem, inner);
+    if (wmalloc(mem) != first || cmem->last != outer.complelast) {
+        puts("releaseSysMem failed.");
+        return -1;
+    }
+
+    resetSysMem(mem);
+    resetCompleMem(cmem);
+    if (wmalloc(mem) != 0 || mem->allsize < allsize) {
+        puts("resetSysMem failed.");
+        return -1;
+    }
+
+    //外側までreleaseした後は、lastが内側のmarkを超えて伸びても内側のmarkは使えない
+    resetSysMem(mem);
+    outer = markSysMem(mem);
+    wmalloc(mem);
+    wmalloc(mem);
+    inner = markSysMem(mem);
+    wmalloc(mem);
+    releaseSysMem(mem, outer);
+    for (i = 0; i < 6; i++) {
+        wmalloc(mem);
+    }
+    releaseSysMem(mem, inner);
+    if (wmalloc(mem) != 6 * mem->blocksize) {
+        puts("stale mark was released.");
+        return -1;
+    }
+    //直前にreleaseしたmarkへは何度でもreleaseできる
+    SysMark again = markSysMem(mem);
+    markSysMem(mem);
+    wmalloc(mem);
+    releaseSysMem(mem, again);
+    wmalloc(mem);
+    releaseSysMem(mem, again);
+    if (mem->last != again.last) {
+        puts("repeated release failed.");
+        return -1;
+    }
+    //reset前のmarkも同様
+    releaseSysMem(mem, outer);
+    resetSysMem(mem);
+    wmalloc(mem);
+    releaseSysMem(mem, outer);
+    if (mem->last != 1) {
+        puts("mark before reset was released.");
+        return -1;
+    }
+
+    printf("Arena: %lu Pointers kept after reset\n", (unsigned long)mem->allsize);
+    deleteCompleMem(&cmem);
+    deleteSysMem(&mem);
+    return 0;
+}
+
+//所有スレッドだけでpush/pop/stealし、拡張と配列の再利用を確かめる。
+//ブロックが小さいのでディレクトリは3段になる
+int testDeque(void)
+{
+    const intptr_t n = 5000;
+    SysMem mem = initSysMem(128, 16, 16);
+    if (mem == NULL) {
+        return -1;
+    }
+
+    wmptr_t last = 0;
+    int round;
+    for (round = 0; round < 3; round++) {
+        SysDeque dq = initSysDeque(mem);
+        if (dq == (SysDeque)WMPNULL || mem->pincount != 1) {
+            puts("initSysDeque failed.");
+            return -1;
+        }
+
+        intptr_t i;
+        void *p;
+        for (i = 1; i <= n; i++) {
+            if (pushDeque(mem, dq, (void *)i) != 0) {
+                printf("pushDeque failed: %ld\n", (long)i);
+                return -1;
+            }
+        }
+        //popは後ろから、stealは前から取り出す
+        for (i = n; i > n - 100; i--) {
+            if (popDeque(mem, dq, &p) != 1 || p != (void *)i) {
+                printf("popDeque mismatch: %ld\n", (long)i);
+                return -1;
+            }
+        }
+        for (i = 1; i <= 100; i++) {
+            if (stealDeque(mem, dq, &p) != 1 || p != (void *)i) {
+                printf("stealDeque mismatch: %ld\n", (long)i);
+                return -1;
+            }
+        }
+        for (i = n - 100; i > 100; i--) {
+            if (popDeque(mem, dq, &p) != 1 || p != (void *)i) {
+                printf("popDeque mismatch: %ld\n", (long)i);
+                return -1;
+            }
+        }
+        if (popDeque(mem, dq, &p) != 0 || stealDeque(mem, dq, &p) != 0) {
+            puts("deque is not empty.");
+            return -1;
+        }
+
+        deleteSysDeque(mem, &dq);
+        if (dq != (SysDeque)WMPNULL || mem->pincount != 0) {
+            puts("deleteSysDeque failed.");
+            return -1;
+        }
+
+        //2回目以降は返却した配列だけで足りる
+        if (round == 0) {
+            last = mem->last;
+        } else if (mem->last != last) {
+            printf("deque blocks leaked: %lu -> %lu\n", (unsigned long)last, (unsigned long)mem->last);
+            return -1;
+        }
+    }
+
+    //pinは予算を書き換えず、複数のdequeを作成と同じ順に削除しても外れない
+    SysDeque dq1 = initSysDeque(mem);
+    setSysMemBudget(mem, 0, mem->allsize * sizeof(Pointer) * 2, NULL);
+    SysDeque dq2 = initSysDeque(mem);
+    Pointer *data = mem->data;
+    size_t allsize = mem->allsize;
+    deleteSysDeque(mem, &dq1);
+    trimSysMem(mem);
+    if (mem->pincount != 1 || mem->data != data || mem->allsize != allsize || mem->hardlimit != mem->allsize * sizeof(Pointer) * 2) {
+        puts("SysDeque pin failed.");
+        return -1;
+    }
+    deleteSysDeque(mem, &dq2);
+    if (mem->pincount != 0) {
+        puts("SysDeque unpin failed.");
+        return -1;
+    }
+
+    printf("Deque: %ld items, %lu blocks reused\n", (long)n, (unsigned long)last);
+    deleteSysMem(&mem);
+    return 0;
+}
+
+static int softcount = 0;
+
+int softLimitHook(SysMem mem, size_t committed, size_t limit)
+{
+    softcount++;
+    return 0;
+}
+
+//ハードリミットに達したpushは何も書かずに失敗し、積めた分はそのまま取り出せる
+int testStackBudget(void)
+{
+    CompleMem cmem = initCompleMem(1, 16, complemem_blocksize_default);
+    SysMem mem = combine(initSysMem(1, 16, 32), cmem);
+    if (mem == NULL) {
+        return -1;
+    }
+    setSysMemBudget(mem, 0, mem->allsize * sizeof(Pointer), NULL);
+
+    SysStack stk = initSysStack(mem);
+    intptr_t i, pushed = 0;
+    for (i = 0; i < 1000; i++) {
+        if (push(mem, stk, (void *)(i + 1)) == 0) {
+            pushed++;
+        }
+    }
+    if (pushed == 0 || pushed == 1000) {
+        printf("push under hard limit: %ld\n", (long)pushed);
+        return -1;
+    }
+    for (i = pushed; i > 0; i--) {
+        if (pop(mem, stk) != (void *)i) {
+            printf("pop mismatch: %ld\n", (long)i);
+            return -1;
+        }
+    }
+
+    printf("StackBudget: %ld of 1000 pushed\n", (long)pushed);
+    deleteCompleMem(&cmem);
+    deleteSysMem(&mem);
+    return 0;
+}
+
+static void *globalBudgetMain(void *arg)
+{
+    SysMem mem = (SysMem)arg;
+    while (wmalloc(mem) != WMPNULL) {
+    }
+    return NULL;
+}
+
+//複数のスレッドが同時に拡張してもグローバルのハードリミットをちょうど使い切る
+int testGlobalBudget(void)
+{
+    const int threads = 4;
+    SysMem mem[threads];
+    pthread_t th[threads];
+    int i;
+
+    for (i = 0; i < threads; i++) {
+        mem[i] = initSysMem(1, 16, 32);
+        if (mem[i] == NULL) {
+            return -1;
+        }
+    }
+    size_t page = mem[0]->pagesize * sizeof(Pointer);
+    size_t limit = committedSize() + page * 64;
+    setGlobalBudget(0, limit, NULL);
+
+    for (i = 0; i < threads; i++) {
+        pthread_create(&th[i], NULL, globalBudgetMain, mem[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(th[i], NULL);
+    }
+    setGlobalBudget(0, 0, NULL);
+
+    if (committedSize() != limit) {
+        printf("global budget: %lu != %lu\n", (unsigned long)committedSize(), (unsigned long)limit);
+        return -1;
+    }
+
+    printf("GlobalBudget: %d threads reached the hard limit\n", threads);
+    for (i = 0; i < threads; i++) {
+        deleteSysMem(&mem[i]);
+    }
+    return 0;
+}
+
+int testBudget(void)
+{
+    CompleMem cmem = initCompleMem(1, 16, complemem_blocksize_default);
+    SysMem mem = combine(initSysMem(1, 16, 32), cmem);
+    if (mem == NULL) {
+        return -1;
+    }
+
+    //4ページでソフトリミット、8ページでハードリミット
+    size_t page = mem->pagesize * sizeof(Pointer);
+    setSysMemBudget(mem, page * 4, page * 8, softLimitHook);
+
+    size_t committed = committedSize();
+    int n = 0;
+    while (wmalloc(mem) != WMPNULL) {
+        n++;
+    }
+    if (mem->allsize * sizeof(Pointer) != page * 8 || softcount != 4) {
+        printf("budget failed: %lu %d\n", (unsigned long)mem->allsize, softcount);
+        return -1;
+    }
+    if (committedSize() != committed + page * 7) {
+        puts("committedSize mismatch.");
+        return -1;
+    }
+
+    resetSysMem(mem);
+    resetCompleMem(cmem);
+    //pinされている間はtrimしない
+    pinSysMem(mem);
+    trimSysMem(mem);
+    if (mem->allsize * sizeof(Pointer) != page * 8) {
+        puts("trimSysMem moved a pinned SysMem.");
+        return -1;
+    }
+    unpinSysMem(mem);
+    trimSysMem(mem);
+    if (committedSize() != committed) {
+        puts("trimSysMem failed.");
+        return -1;
+    }
+
+    printf("Budget: %d blocks until hard limit\n", n);
+    deleteCompleMem(&cmem);
+    deleteSysMem(&mem);
+    return 0;
+}
+
 int main(void)
 {
     CompleMem cmem = initCompleMem(1, 256, complemem_blocksize_default);
@@ -45,6 +497,42 @@ int main(void)
         printf("%p\n", mp);
     }
 
+    puts("------------------------------------------------");
+
+    //ハッシュ表は大きめのブロックを使う
+    CompleMem hcmem = initCompleMem(1, 16, complemem_blocksize_default);
+    SysMem hmem = combine(initSysMem(1, 256, 768), hcmem);
+    if (testHash(hmem) != 0) {
+        return EXIT_FAILURE;
+    }
+    if (testHashReuse(hmem) != 0) {
+        return EXIT_FAILURE;
+    }
+    if (testHashSmallBlock() != 0) {
+        return EXIT_FAILURE;
+    }
+    deleteCompleMem(&hcmem);
+    deleteSysMem(&hmem);
+
+    if (testArena() != 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (testDeque() != 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (testBudget() != 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (testStackBudget() != 0) {
+        return EXIT_FAILURE;
+    }
+    if (testGlobalBudget() != 0) {
+        return EXIT_FAILURE;
+    }
+
     deleteCompleMem(&cmem);
     deleteSysMem(&mem);
     return EXIT_SUCCESS;